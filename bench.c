@@ -0,0 +1,143 @@
+/*
+ * Benchmark for echfs-fuse.
+ *
+ * Drives the FUSE operations in-process against an image, so the numbers
+ * show the cost of echfs-fuse itself and not that of the kernel, whose
+ * dentry and page caches would otherwise hide most of it.
+ *
+ * Usage: echfs-bench <image> [path cache size]
+ * The image should be freshly formatted; see `make bench`.
+ */
+
+#define main echfs_fuse_main
+#include "echfs-fuse.c"
+#undef main
+
+#define BENCH_DIRS      32
+#define BENCH_FILES     64
+#define BENCH_LOOKUPS   200000
+#define BENCH_FILE_SIZE (64 * 1024 * 1024)
+#define BENCH_SEQ_CHUNK (128 * 1024)
+#define BENCH_RND_CHUNK 4096
+#define BENCH_RND_READS 16384
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int populate(void) {
+    char path[64];
+    struct fuse_file_info fi;
+
+    if (operations.mkdir("/bench", 0755))
+        return -1;
+    for (int d = 0; d < BENCH_DIRS; d++) {
+        snprintf(path, sizeof(path), "/bench/d%02d", d);
+        if (operations.mkdir(path, 0755))
+            return -1;
+        for (int f = 0; f < BENCH_FILES; f++) {
+            snprintf(path, sizeof(path), "/bench/d%02d/f%02d", d, f);
+            memset(&fi, 0, sizeof(fi));
+            if (operations.create(path, 0644, &fi))
+                return -1;
+            operations.release(path, &fi);
+        }
+    }
+    return 0;
+}
+
+static int bench_lookups(void) {
+    char path[64];
+    struct stat st;
+
+    srand(1);
+    double start = now();
+    for (int i = 0; i < BENCH_LOOKUPS; i++) {
+        snprintf(path, sizeof(path), "/bench/d%02d/f%02d",
+                rand() % BENCH_DIRS, rand() % BENCH_FILES);
+        if (operations.getattr(path, &st))
+            return -1;
+    }
+    double secs = now() - start;
+    printf("lookup:     %10.0f getattr/s\n", BENCH_LOOKUPS / secs);
+    return 0;
+}
+
+static int bench_io(void) {
+    const char *path = "/bench/data";
+    struct fuse_file_info fi = {0};
+    char *buf = malloc(BENCH_SEQ_CHUNK);
+    int ret = -1;
+
+    if (!buf)
+        return -1;
+    for (int i = 0; i < BENCH_SEQ_CHUNK; i++)
+        buf[i] = (char)i;
+    if (operations.create(path, 0644, &fi))
+        goto out;
+
+    double start = now();
+    for (off_t off = 0; off < BENCH_FILE_SIZE; off += BENCH_SEQ_CHUNK)
+        if (operations.write(path, buf, BENCH_SEQ_CHUNK, off, &fi)
+                != BENCH_SEQ_CHUNK)
+            goto out_release;
+    double secs = now() - start;
+    printf("seq write:  %10.1f MB/s\n", BENCH_FILE_SIZE / secs / 1e6);
+
+    start = now();
+    for (off_t off = 0; off < BENCH_FILE_SIZE; off += BENCH_SEQ_CHUNK)
+        if (operations.read(path, buf, BENCH_SEQ_CHUNK, off, &fi)
+                != BENCH_SEQ_CHUNK)
+            goto out_release;
+    secs = now() - start;
+    printf("seq read:   %10.1f MB/s\n", BENCH_FILE_SIZE / secs / 1e6);
+
+    srand(1);
+    start = now();
+    for (int i = 0; i < BENCH_RND_READS; i++) {
+        off_t off = (off_t)(rand() % (BENCH_FILE_SIZE / BENCH_RND_CHUNK))
+            * BENCH_RND_CHUNK;
+        if (operations.read(path, buf, BENCH_RND_CHUNK, off, &fi)
+                != BENCH_RND_CHUNK)
+            goto out_release;
+    }
+    secs = now() - start;
+    printf("rand read:  %10.1f MB/s\n",
+            (double)BENCH_RND_READS * BENCH_RND_CHUNK / secs / 1e6);
+    ret = 0;
+
+out_release:
+    operations.release(path, &fi);
+out:
+    free(buf);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <image> [path cache size]\n", argv[0]);
+        return 1;
+    }
+
+    echfs.image_path = argv[1];
+    echfs.path_cache_size = argc > 2 ? (unsigned)atoi(argv[2]) : 4096;
+    if (!echfs.path_cache_size)
+        echfs.path_cache_size = 1;
+    echfs.readahead = 1024 * 1024;
+
+    struct fuse_conn_info conn = {0};
+    conn.capable = ~0u;
+    conn.max_write = BENCH_SEQ_CHUNK;
+    operations.init(&conn);
+
+    printf("block size %lu, path cache size %u\n",
+            echfs.bytes_per_block, echfs.path_cache_size);
+    int ret = populate() || bench_lookups() || bench_io();
+    if (ret)
+        fprintf(stderr, "benchmark failed\n");
+
+    operations.destroy(NULL);
+    return ret;
+}
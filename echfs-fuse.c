@@ -1,6 +1,7 @@
 #define FUSE_USE_VERSION 29
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <string.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -8,6 +9,10 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 
 #include "part.h"
@@ -24,9 +29,14 @@
 #define RESERVED_BLOCK          0xfffffffffffffff0
 #define END_OF_CHAIN            0xffffffffffffffff
 
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE     0x01
+#endif
+
 //max handles for now
 #define MAX_HANDLES 1024
 #define MAX_PATH_LEN 4096
+#define CACHE_SHARDS 16
 
 struct entry_t {
     uint64_t parent_id;
@@ -42,31 +52,187 @@ struct entry_t {
     uint64_t size;
 }__attribute__((packed));
 
+/*
+ * a resolved path. The entry itself is read from dir_table through
+ * path_entry(), so nothing here can go stale against the directory.
+ * For a failed lookup, parent_id is the directory the last component
+ * would be created in. In low-level mode the same structure is an inode,
+ * with no path, and failure set once its entry is deleted.
+ */
 struct path_result_t {
+    uint64_t hash;
+    char *path;
     uint64_t target_entry;
-    struct entry_t target;
-    struct entry_t parent;
-    char name[FILENAME_LEN];
-    char path[MAX_PATH_LEN];
+    uint64_t parent_id;
+    struct entry_t *orphan;
+    uint64_t refs;
     int failure;
-    int not_found;
-    uint8_t type;
+    int accessed;
     struct path_result_t *next;
+    struct path_result_t *lru_prev, *lru_next;
+
+    /* mtime and size of the file when a handle on it was last opened or
+     * released, to tell whether the kernel's cached pages still hold */
+    uint64_t cached_mtime;
+    uint64_t cached_size;
+    int cache_valid;
+
+    /* low-level mode: the inode number, the lookups the kernel holds and
+     * the inode table chains */
+    uint64_t ino;
+    uint64_t nlookup;
+    struct path_result_t *ino_next, *slot_next;
+};
+
+/* a data block held by the block cache, chained in its shard's buckets */
+struct cached_block {
+    uint64_t block;
+    uint8_t *data;
+    int valid;
+    int dirty;
+    int referenced;
+    struct cached_block *next;
+    struct cached_block *dirty_prev, *dirty_next;
+};
+
+/*
+ * one shard of the data block cache. Blocks go to shards by number, each
+ * shard has its own lock and evicts with a CLOCK hand, writing a dirty
+ * victim back before reusing it.
+ */
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cached_block *slots;
+    uint64_t count;
+    uint64_t hand;
+    struct cached_block **buckets;
+    uint64_t mask;
+    uint8_t *data;
+    /* dirty blocks, so that a flush only visits those */
+    struct cached_block *dirty_head;
+    uint64_t dirty_count;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/* physically contiguous run of a file, covering the logical blocks
+ * logical .. logical + length - 1 */
+struct extent_t {
+    uint64_t logical;
+    uint64_t start;
+    uint64_t length;
+};
+
+/*
+ * extent list of an open file, shared by every handle open on the same
+ * directory slot and freed along with the last of them. entry is set to
+ * SEARCH_FAILURE once the file is unlinked, so that a new file reusing
+ * the slot never picks up a stale list.
+ */
+struct extent_map {
+    uint64_t entry;
+    uint64_t refs;
+    /* held for reading while a read or write uses the list, and for
+     * writing by whatever changes it */
+    pthread_rwlock_t lock;
+    struct extent_t *extents;
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t total_blocks;
+    struct extent_map *next;
 };
 
 struct echfs_handle_t {
     uint8_t occupied;
+    /* set by release while reads or writes are still using the handle;
+     * the slot is freed once the last of them is done */
+    uint8_t closed;
+    /* one for the open file plus one per read or write in flight */
+    uint64_t refs;
     char path[MAX_PATH_LEN];
     int flags;
     struct path_result_t *path_res;
-    uint64_t *alloc_map;
-    uint64_t total_blocks;
+    struct extent_map *extents;
+    /* where a sequential read would continue, and how far ahead of it the
+     * image has been advised; updated with atomics by the reads holding
+     * a reference on the handle */
+    uint64_t next_read;
+    uint64_t readahead_end;
 };
 
+/*
+ * bounded cache of resolved paths, including failed lookups whose parent
+ * directory exists. Results are reference counted and the cache holds one
+ * reference of its own, so entries pinned by open handles or by an
+ * operation in flight are never freed from under them. Hits only set
+ * `accessed`, which keeps lookups under the read lock; eviction walks the
+ * LRU list from the tail and gives accessed entries a second chance.
+ */
 struct path_result_table {
     struct path_result_t **table;
     uint64_t size;
     uint64_t num_elements;
+    uint64_t max_elements;
+    struct path_result_t *lru_head, *lru_tail;
+};
+
+/*
+ * inodes known to the kernel in low-level mode, hashed by inode number
+ * and, unless deleted, by slot. An inode is numbered after the slot it
+ * was looked up in, plus a generation in the top bits if an inode of a
+ * deleted entry still holds that number. Compaction moves the slot of an
+ * inode but never its number. The table holds one reference to each
+ * inode.
+ */
+struct inode_table {
+    struct path_result_t **by_ino;
+    struct path_result_t **by_slot;
+    uint64_t mask;
+    uint64_t num_elements;
+};
+
+/*
+ * slots of the live entries of one directory, sorted so that a readdir
+ * cookie derived from the slot stays valid across insertions and
+ * removals. Directories without children have no list.
+ */
+struct dir_children {
+    uint64_t dir_id;
+    uint64_t *slots;
+    uint64_t count;
+    uint64_t capacity;
+    struct dir_children *next;
+};
+
+/*
+ * hash index of the live directory entries, keyed by (parent_id, name).
+ * buckets and chain hold slot numbers plus one, with 0 ending a chain;
+ * chain is indexed by slot so the index never allocates per entry.
+ */
+struct dir_index {
+    uint64_t *buckets;
+    uint64_t *chain;
+    uint64_t mask;
+    uint64_t num_elements;
+
+    /* child lists, hashed by directory ID */
+    struct dir_children **dirs;
+    uint64_t dirs_mask;
+    uint64_t num_dirs;
+
+    /* directory IDs above next_dir_id are unused, and so are the IDs of
+     * removed directories kept in free_dir_ids */
+    uint64_t next_dir_id;
+    uint64_t *free_dir_ids;
+    uint64_t free_dir_count;
+    uint64_t free_dir_capacity;
+
+    /* end is the slot of the end-of-directory marker. Deleted slots below
+     * it are set in deleted_map, none of them in words before
+     * deleted_hint */
+    uint64_t end;
+    uint64_t *deleted_map;
+    uint64_t deleted_hint;
 };
 
 static struct echfs {
@@ -78,6 +244,10 @@ static struct echfs {
     uint64_t part_offset;
 
     FILE *image;
+    int fd;
+    int use_mmap;
+    uint8_t *map;
+    uint64_t map_delta;
     uint64_t image_size;
     uint64_t blocks;
     uint64_t fat_size;
@@ -90,11 +260,62 @@ static struct echfs {
     uint64_t entries_per_block;
 
     struct path_result_table path_cache;
+    struct inode_table inodes;
     struct entry_t *dir_table;
+    struct dir_index dir_index;
     uint64_t *fat;
+    uint64_t *dir_dirty;
+    uint64_t *fat_dirty;
+    uint64_t *free_map;
+    uint64_t free_blocks;
+    uint64_t alloc_cursor;
+
+    /*
+     * Locks are always taken in the order handles_lock, the lock of an
+     * open file's extent list, dir_lock, cache_lock, fat_lock. Reads and
+     * writes hold a reference on their handle instead of handles_lock.
+     * dir_lock also covers the path results hanging off the cache and the
+     * inodes, as those mirror dir_table entries. cache_lock covers the
+     * inode table as well, and fat_lock the free block map. The dirty
+     * block bitmaps are set under the lock of their table; flush_lock,
+     * which serializes write-back, is taken before any of the above. The
+     * block cache shard locks come last and nothing is taken under them.
+     */
+    pthread_rwlock_t dir_lock;
+    pthread_rwlock_t cache_lock;
+    pthread_rwlock_t fat_lock;
+    pthread_mutex_t flush_lock;
+
+    unsigned flush_interval;
+    unsigned path_cache_size;
+    unsigned cache_timeout;
+    uint64_t readahead;
+    uint64_t cache_size;
+    int compact;
+    int lowlevel;
+    int writeback_cache;
+    int writeback_running;
+    int writeback_stop;
+    pthread_t writeback_thread;
+    pthread_mutex_t writeback_mutex;
+    pthread_cond_t writeback_cond;
 }  echfs;
 
 static struct echfs_handle_t handles[MAX_HANDLES];
+static pthread_rwlock_t handles_lock;
+/* data block cache, only set up when echfs.cache_size is non zero */
+static struct cache_shard block_cache[CACHE_SHARDS];
+/* extent lists of the open files, protected by handles_lock */
+static struct extent_map *open_files;
+
+/* stands in for the root directory, which has no directory entry */
+static struct entry_t root_entry = {
+    .parent_id = ROOT_ID,
+    .type = DIRECTORY_TYPE,
+    .name = "/",
+    .perms = 0755,
+    .payload = ROOT_ID,
+};
 
 static char *internal_strchrnul(const char *s, char c) {
     while (*s) {
@@ -120,34 +341,595 @@ static void cleanup_fuse() {
     fuse_remove_signal_handlers(echfs.session);
 }
 
-static inline int echfs_fseek(FILE *file, long loc, int mode) {
-    return fseek(file, echfs.part_offset + loc, mode);
+/* maps the partition, the mapping has to start on a page boundary */
+static int map_image() {
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    echfs.map_delta = echfs.part_offset % page_size;
+    void *base = mmap(NULL, echfs.image_size + echfs.map_delta,
+            PROT_READ | PROT_WRITE, MAP_SHARED, echfs.fd,
+            echfs.part_offset - echfs.map_delta);
+    if (base == MAP_FAILED)
+        return -1;
+    echfs.map = (uint8_t *)base + echfs.map_delta;
+    return 0;
+}
+
+static int echfs_pread(void *buf, uint64_t count, uint64_t loc) {
+    if (echfs.map) {
+        if (loc + count > echfs.image_size)
+            return -EIO;
+        memcpy(buf, echfs.map + loc, count);
+        return 0;
+    }
+
+    uint8_t *ptr = buf;
+    while (count) {
+        ssize_t ret = pread(echfs.fd, ptr, count, echfs.part_offset + loc);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -EIO;
+        ptr += ret;
+        loc += ret;
+        count -= ret;
+    }
+    return 0;
+}
+
+static int echfs_pwrite(const void *buf, uint64_t count, uint64_t loc) {
+    if (echfs.map) {
+        if (loc + count > echfs.image_size)
+            return -EIO;
+        memcpy(echfs.map + loc, buf, count);
+        return 0;
+    }
+
+    const uint8_t *ptr = buf;
+    while (count) {
+        ssize_t ret = pwrite(echfs.fd, ptr, count, echfs.part_offset + loc);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -EIO;
+        ptr += ret;
+        loc += ret;
+        count -= ret;
+    }
+    return 0;
+}
+
+/* every shard gets the same whole number of blocks, at least one, so the
+ * size is rounded to a multiple of CACHE_SHARDS blocks */
+static int init_block_cache() {
+    uint64_t per_shard = echfs.cache_size / echfs.bytes_per_block /
+        CACHE_SHARDS;
+    if (!per_shard)
+        per_shard = 1;
+    uint64_t buckets = 1;
+    while (buckets < per_shard)
+        buckets <<= 1;
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &block_cache[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->count = per_shard;
+        shard->mask = buckets - 1;
+        shard->slots = calloc(per_shard, sizeof(struct cached_block));
+        shard->buckets = calloc(buckets, sizeof(struct cached_block *));
+        shard->data = malloc(per_shard * echfs.bytes_per_block);
+        if (!shard->slots || !shard->buckets || !shard->data)
+            return -1;
+        for (uint64_t j = 0; j < per_shard; j++)
+            shard->slots[j].data = shard->data + j * echfs.bytes_per_block;
+    }
+    return 0;
+}
+
+static void free_block_cache() {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &block_cache[i];
+        free(shard->slots);
+        free(shard->buckets);
+        free(shard->data);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    memset(block_cache, 0, sizeof(block_cache));
+}
+
+static void mark_cached_dirty(struct cache_shard *shard,
+        struct cached_block *cached) {
+    if (cached->dirty)
+        return;
+    cached->dirty = 1;
+    cached->dirty_prev = NULL;
+    cached->dirty_next = shard->dirty_head;
+    if (shard->dirty_head)
+        shard->dirty_head->dirty_prev = cached;
+    shard->dirty_head = cached;
+    __atomic_store_n(&shard->dirty_count, shard->dirty_count + 1,
+            __ATOMIC_RELAXED);
+}
+
+static void mark_cached_clean(struct cache_shard *shard,
+        struct cached_block *cached) {
+    if (!cached->dirty)
+        return;
+    cached->dirty = 0;
+    if (cached->dirty_prev)
+        cached->dirty_prev->dirty_next = cached->dirty_next;
+    else
+        shard->dirty_head = cached->dirty_next;
+    if (cached->dirty_next)
+        cached->dirty_next->dirty_prev = cached->dirty_prev;
+    __atomic_store_n(&shard->dirty_count, shard->dirty_count - 1,
+            __ATOMIC_RELAXED);
+}
+
+static inline struct cache_shard *block_shard(uint64_t block) {
+    return &block_cache[block % CACHE_SHARDS];
+}
+
+static inline struct cached_block **block_bucket(struct cache_shard *shard,
+        uint64_t block) {
+    uint64_t hash = (block / CACHE_SHARDS) * 0x9e3779b97f4a7c15ull;
+    return &shard->buckets[(hash >> 32) & shard->mask];
+}
+
+/*
+ * returns the cached copy of `block`, making room for it if needed. The
+ * block is only read from the image when `fill` is set, a caller about to
+ * overwrite all of it doesn't need the old contents. Must be called with
+ * the shard lock held.
+ */
+static struct cached_block *cache_get(struct cache_shard *shard,
+        uint64_t block, int fill) {
+    struct cached_block **bucket = block_bucket(shard, block);
+    for (struct cached_block *cached = *bucket; cached;
+            cached = cached->next) {
+        if (cached->block == block) {
+            cached->referenced = 1;
+            shard->hits++;
+            return cached;
+        }
+    }
+    shard->misses++;
+
+    struct cached_block *victim;
+    for (;;) {
+        victim = &shard->slots[shard->hand];
+        shard->hand = (shard->hand + 1) % shard->count;
+        if (!victim->valid || !victim->referenced)
+            break;
+        victim->referenced = 0;
+    }
+
+    if (victim->valid) {
+        if (victim->dirty && echfs_pwrite(victim->data, echfs.bytes_per_block,
+                    victim->block * echfs.bytes_per_block))
+            return NULL;
+        struct cached_block **link = block_bucket(shard, victim->block);
+        while (*link != victim)
+            link = &(*link)->next;
+        *link = victim->next;
+        victim->valid = 0;
+        mark_cached_clean(shard, victim);
+    }
+
+    if (fill && echfs_pread(victim->data, echfs.bytes_per_block,
+                block * echfs.bytes_per_block))
+        return NULL;
+    victim->block = block;
+    victim->valid = 1;
+    victim->referenced = 1;
+    victim->next = *bucket;
+    *bucket = victim;
+    return victim;
+}
+
+/* copies [loc, loc + count) of the image through the block cache */
+static int cached_io(void *buf, uint64_t count, uint64_t loc, int write) {
+    uint8_t *ptr = buf;
+    while (count) {
+        uint64_t block = loc / echfs.bytes_per_block;
+        uint64_t block_offset = loc % echfs.bytes_per_block;
+        uint64_t chunk = echfs.bytes_per_block - block_offset;
+        if (chunk > count)
+            chunk = count;
+
+        struct cache_shard *shard = block_shard(block);
+        pthread_mutex_lock(&shard->lock);
+        struct cached_block *cached = cache_get(shard, block,
+                !write || chunk != echfs.bytes_per_block);
+        if (!cached) {
+            pthread_mutex_unlock(&shard->lock);
+            return -EIO;
+        }
+        if (write) {
+            memcpy(cached->data + block_offset, ptr, chunk);
+            mark_cached_dirty(shard, cached);
+        } else {
+            memcpy(ptr, cached->data + block_offset, chunk);
+        }
+        pthread_mutex_unlock(&shard->lock);
+
+        ptr += chunk;
+        loc += chunk;
+        count -= chunk;
+    }
+    return 0;
+}
+
+/* file data goes through the block cache when there is one */
+static int data_pread(void *buf, uint64_t count, uint64_t loc) {
+    if (echfs.cache_size)
+        return cached_io(buf, count, loc, 0);
+    return echfs_pread(buf, count, loc);
+}
+
+static int data_pwrite(const void *buf, uint64_t count, uint64_t loc) {
+    if (echfs.cache_size)
+        return cached_io((void *)buf, count, loc, 1);
+    return echfs_pwrite(buf, count, loc);
+}
+
+/* writes every dirty cached block back to the image, skipping clean
+ * shards without taking their lock */
+static int flush_block_cache() {
+    if (!echfs.cache_size)
+        return 0;
+    int ret = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &block_cache[i];
+        if (!__atomic_load_n(&shard->dirty_count, __ATOMIC_RELAXED))
+            continue;
+        pthread_mutex_lock(&shard->lock);
+        struct cached_block *cached = shard->dirty_head;
+        while (cached) {
+            struct cached_block *next = cached->dirty_next;
+            /* a block that fails to write stays dirty for the next flush */
+            if (echfs_pwrite(cached->data, echfs.bytes_per_block,
+                        cached->block * echfs.bytes_per_block))
+                ret = -EIO;
+            else
+                mark_cached_clean(shard, cached);
+            cached = next;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return ret;
 }
 
-static inline uint16_t rd_word(long loc) {
+static inline uint16_t rd_word(uint64_t loc) {
     uint16_t x = 0;
-    echfs_fseek(echfs.image, loc, SEEK_SET);
-    int ret = fread(&x, 2, 1, echfs.image);
-    if (ret != 1)
+    if (echfs_pread(&x, 2, loc))
         fprintf(stderr, "error reading word!\n");
     return x;
 }
 
-static inline uint64_t rd_qword(long loc) {
+static inline uint64_t rd_qword(uint64_t loc) {
     uint64_t x = 0;
-    echfs_fseek(echfs.image, loc, SEEK_SET);
-    int ret = fread(&x, 8, 1, echfs.image);
-    if (ret != 1)
+    if (echfs_pread(&x, 8, loc))
         fprintf(stderr, "error reading qword!\n");
     return x;
 }
 
-static void rd_entry(struct entry_t *entry, uint64_t pos) {
-    memcpy(entry, echfs.dir_table + pos, sizeof(struct entry_t));
+static inline uint64_t hash_str(const char *str) {
+    unsigned long hash = 5381;
+    int c;
+    while ((c = *str++))
+        hash = ((hash << 5) + hash) + c;
+    return hash;
+}
+
+static inline int is_live_entry(const struct entry_t *entry) {
+    return entry->parent_id && entry->parent_id != DELETED_ENTRY;
+}
+
+static inline uint64_t hash_child(uint64_t parent, const char *name) {
+    return hash_str(name) ^ (parent * 0x9e3779b97f4a7c15);
+}
+
+static void index_link(uint64_t pos) {
+    struct entry_t *entry = &echfs.dir_table[pos];
+    uint64_t bucket = hash_child(entry->parent_id, entry->name) &
+        echfs.dir_index.mask;
+    echfs.dir_index.chain[pos] = echfs.dir_index.buckets[bucket];
+    echfs.dir_index.buckets[bucket] = pos + 1;
+}
+
+static void index_grow() {
+    uint64_t new_size = (echfs.dir_index.mask + 1) * 2;
+    free(echfs.dir_index.buckets);
+    echfs.dir_index.buckets = calloc(new_size, sizeof(uint64_t));
+    echfs.dir_index.mask = new_size - 1;
+
+    uint64_t slots = echfs.dir_size * echfs.entries_per_block;
+    for (uint64_t i = 0; i < slots; i++) {
+        if (!echfs.dir_table[i].parent_id) break;
+        if (is_live_entry(&echfs.dir_table[i]))
+            index_link(i);
+    }
+}
+
+static inline uint64_t hash_dir_id(uint64_t id) {
+    return ((id * 0x9e3779b97f4a7c15) >> 32) & echfs.dir_index.dirs_mask;
+}
+
+static struct dir_children *find_children(uint64_t dir_id) {
+    struct dir_children *dir = echfs.dir_index.dirs[hash_dir_id(dir_id)];
+    for (; dir; dir = dir->next) {
+        if (dir->dir_id == dir_id)
+            return dir;
+    }
+    return NULL;
+}
+
+/* first position in the list whose slot is not below `slot` */
+static uint64_t children_lower_bound(struct dir_children *dir, uint64_t slot) {
+    uint64_t lo = 0, hi = dir->count;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (dir->slots[mid] < slot)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int children_grow() {
+    uint64_t new_size = (echfs.dir_index.dirs_mask + 1) * 2;
+    struct dir_children **dirs = calloc(new_size, sizeof(struct dir_children *));
+    if (!dirs)
+        return -1;
+
+    struct dir_children **old = echfs.dir_index.dirs;
+    uint64_t old_size = echfs.dir_index.dirs_mask + 1;
+    echfs.dir_index.dirs = dirs;
+    echfs.dir_index.dirs_mask = new_size - 1;
+    for (uint64_t i = 0; i < old_size; i++) {
+        while (old[i]) {
+            struct dir_children *dir = old[i];
+            old[i] = dir->next;
+            uint64_t bucket = hash_dir_id(dir->dir_id);
+            dir->next = dirs[bucket];
+            dirs[bucket] = dir;
+        }
+    }
+    free(old);
+    return 0;
+}
+
+static void child_insert(uint64_t pos) {
+    uint64_t dir_id = echfs.dir_table[pos].parent_id;
+    struct dir_children *dir = find_children(dir_id);
+    if (!dir) {
+        if (echfs.dir_index.num_dirs >= echfs.dir_index.dirs_mask + 1)
+            children_grow();
+        dir = calloc(1, sizeof(struct dir_children));
+        if (!dir)
+            goto oom;
+        dir->dir_id = dir_id;
+        uint64_t bucket = hash_dir_id(dir_id);
+        dir->next = echfs.dir_index.dirs[bucket];
+        echfs.dir_index.dirs[bucket] = dir;
+        echfs.dir_index.num_dirs++;
+    }
+
+    if (dir->count == dir->capacity) {
+        uint64_t capacity = dir->capacity ? dir->capacity * 2 : 8;
+        uint64_t *slots = realloc(dir->slots, capacity * sizeof(uint64_t));
+        if (!slots)
+            goto oom;
+        dir->slots = slots;
+        dir->capacity = capacity;
+    }
+
+    uint64_t i = children_lower_bound(dir, pos);
+    memmove(&dir->slots[i + 1], &dir->slots[i],
+            (dir->count - i) * sizeof(uint64_t));
+    dir->slots[i] = pos;
+    dir->count++;
+    return;
+
+oom:
+    fprintf(stderr, "out of memory for the child list of slot %lu!\n", pos);
+}
+
+static void child_remove(uint64_t pos) {
+    uint64_t dir_id = echfs.dir_table[pos].parent_id;
+    struct dir_children **link = &echfs.dir_index.dirs[hash_dir_id(dir_id)];
+    for (; *link; link = &(*link)->next) {
+        if ((*link)->dir_id == dir_id)
+            break;
+    }
+    struct dir_children *dir = *link;
+    if (!dir)
+        return;
+
+    uint64_t i = children_lower_bound(dir, pos);
+    if (i == dir->count || dir->slots[i] != pos)
+        return;
+    memmove(&dir->slots[i], &dir->slots[i + 1],
+            (dir->count - i - 1) * sizeof(uint64_t));
+    if (--dir->count)
+        return;
+
+    *link = dir->next;
+    echfs.dir_index.num_dirs--;
+    free(dir->slots);
+    free(dir);
+}
+
+/* frees what build_dir_index() allocated, but not the free directory IDs */
+static void free_dir_index(struct dir_index *index) {
+    if (index->dirs) {
+        for (uint64_t i = 0; i <= index->dirs_mask; i++) {
+            while (index->dirs[i]) {
+                struct dir_children *dir = index->dirs[i];
+                index->dirs[i] = dir->next;
+                free(dir->slots);
+                free(dir);
+            }
+        }
+    }
+    free(index->dirs);
+    free(index->buckets);
+    free(index->chain);
+    free(index->deleted_map);
+}
+
+/* the entry must already be in dir_table, as growing relinks every entry */
+static void index_insert(uint64_t pos) {
+    echfs.dir_index.num_elements++;
+    if (echfs.dir_index.num_elements > echfs.dir_index.mask + 1)
+        index_grow();
+    else
+        index_link(pos);
+    child_insert(pos);
+}
+
+static void index_remove(uint64_t pos) {
+    struct entry_t *entry = &echfs.dir_table[pos];
+    uint64_t bucket = hash_child(entry->parent_id, entry->name) &
+        echfs.dir_index.mask;
+    uint64_t *link = &echfs.dir_index.buckets[bucket];
+    for (; *link; link = &echfs.dir_index.chain[*link - 1]) {
+        if (*link == pos + 1) {
+            *link = echfs.dir_index.chain[pos];
+            echfs.dir_index.num_elements--;
+            child_remove(pos);
+            return;
+        }
+    }
+}
+
+static uint64_t index_lookup(const char *name, uint64_t parent) {
+    uint64_t bucket = hash_child(parent, name) & echfs.dir_index.mask;
+    uint64_t i = echfs.dir_index.buckets[bucket];
+    for (; i; i = echfs.dir_index.chain[i - 1]) {
+        struct entry_t *entry = &echfs.dir_table[i - 1];
+        if ((entry->parent_id == parent) && (!strcmp(entry->name, name)))
+            return i - 1;
+    }
+    return SEARCH_FAILURE;
+}
+
+static int build_dir_index() {
+    uint64_t slots = echfs.dir_size * echfs.entries_per_block;
+    uint64_t live = 0;
+    for (uint64_t i = 0; i < slots; i++) {
+        if (!echfs.dir_table[i].parent_id) break;
+        if (is_live_entry(&echfs.dir_table[i])) live++;
+    }
+
+    uint64_t size = 1024;
+    while (size < live * 2)
+        size *= 2;
+
+    echfs.dir_index.buckets = calloc(size, sizeof(uint64_t));
+    echfs.dir_index.chain = calloc(slots, sizeof(uint64_t));
+    echfs.dir_index.dirs = calloc(64, sizeof(struct dir_children *));
+    echfs.dir_index.deleted_map = calloc((slots + 63) / 64, sizeof(uint64_t));
+    if (!echfs.dir_index.buckets || !echfs.dir_index.chain ||
+            !echfs.dir_index.dirs || !echfs.dir_index.deleted_map)
+        return -1;
+    echfs.dir_index.mask = size - 1;
+    echfs.dir_index.num_elements = live;
+    echfs.dir_index.dirs_mask = 63;
+    echfs.dir_index.next_dir_id = 1;
+
+    /* slots go in ascending order, so every child is appended */
+    uint64_t i = 0;
+    for (; i < slots; i++) {
+        struct entry_t *entry = &echfs.dir_table[i];
+        if (!entry->parent_id) break;
+        if (!is_live_entry(entry)) {
+            echfs.dir_index.deleted_map[i / 64] |= (uint64_t)1 << (i % 64);
+            continue;
+        }
+        index_link(i);
+        child_insert(i);
+        if (entry->type == DIRECTORY_TYPE &&
+                entry->payload >= echfs.dir_index.next_dir_id)
+            echfs.dir_index.next_dir_id = entry->payload + 1;
+    }
+    echfs.dir_index.end = i;
+    return 0;
+}
+
+static inline void mark_dirty(uint64_t *dirty, uint64_t block) {
+    dirty[block / 64] |= (uint64_t)1 << (block % 64);
+}
+
+static inline int is_dirty(uint64_t *dirty, uint64_t block) {
+    return (dirty[block / 64] >> (block % 64)) & 1;
+}
+
+/* keeps the free slot tracking in step with a slot going from old_parent
+ * to new_parent */
+static void track_slot(uint64_t pos, uint64_t old_parent, uint64_t new_parent) {
+    uint64_t *word = &echfs.dir_index.deleted_map[pos / 64];
+    uint64_t bit = (uint64_t)1 << (pos % 64);
+    if (new_parent == DELETED_ENTRY) {
+        *word |= bit;
+        if (pos / 64 < echfs.dir_index.deleted_hint)
+            echfs.dir_index.deleted_hint = pos / 64;
+    } else if (old_parent == DELETED_ENTRY) {
+        *word &= ~bit;
+    }
+
+    if (new_parent && pos >= echfs.dir_index.end)
+        echfs.dir_index.end = pos + 1;
+    else if (!new_parent && pos + 1 == echfs.dir_index.end)
+        echfs.dir_index.end = pos;
 }
 
+/* keeps dir_index in sync, so must be called with dir_lock held for writing */
 static void wr_entry(struct entry_t *entry, uint64_t pos) {
-    memcpy(echfs.dir_table + pos, entry, sizeof(struct entry_t));
+    struct entry_t *old = &echfs.dir_table[pos];
+    int relink = is_live_entry(old) != is_live_entry(entry) ||
+        old->parent_id != entry->parent_id || strcmp(old->name, entry->name);
+
+    if (old->parent_id != entry->parent_id)
+        track_slot(pos, old->parent_id, entry->parent_id);
+
+    if (relink && is_live_entry(old))
+        index_remove(pos);
+    if (entry != old)
+        memcpy(echfs.dir_table + pos, entry, sizeof(struct entry_t));
+    if (relink && is_live_entry(entry))
+        index_insert(pos);
+    mark_dirty(echfs.dir_dirty, pos / echfs.entries_per_block);
+}
+
+/* must be called with fat_lock held for writing */
+static inline void wr_fat(uint64_t block, uint64_t value) {
+    echfs.fat[block] = value;
+    mark_dirty(echfs.fat_dirty,
+            block * sizeof(uint64_t) / echfs.bytes_per_block);
+}
+
+/* the directory entry a resolved path refers to. Files unlinked while open
+ * keep a private copy, as their slot may be reused. */
+static inline struct entry_t *path_entry(struct path_result_t *path_res) {
+    if (path_res->orphan)
+        return path_res->orphan;
+    if (path_res->target_entry == ROOT_ID)
+        return &root_entry;
+    return &echfs.dir_table[path_res->target_entry];
+}
+
+/* writes back changes made through path_entry(), with dir_lock held for
+ * writing */
+static void sync_entry(struct path_result_t *path_res) {
+    if (!path_res->orphan && path_res->target_entry != ROOT_ID)
+        wr_entry(path_entry(path_res), path_res->target_entry);
+}
+
+static inline const char *path_name(const char *path) {
+    const char *name = strrchr(path, '/');
+    return name ? name + 1 : path;
 }
 
 static inline uint64_t get_time() {
@@ -156,17 +938,10 @@ static inline uint64_t get_time() {
     return time.tv_sec;
 }
 
-static int update_ctime(struct path_result_t *path_res) {
-    uint64_t time = get_time();
-    path_res->target.ctime = time;
-    wr_entry(&path_res->target, path_res->target_entry);
-    return 0;
-}
-
 static int update_mtime(struct path_result_t *path_res) {
     uint64_t time = get_time();
-    path_res->target.mtime = time;
-    wr_entry(&path_res->target, path_res->target_entry);
+    path_entry(path_res)->mtime = time;
+    sync_entry(path_res);
     return 0;
 }
 
@@ -189,145 +964,766 @@ static int detect_cycle(struct path_result_t* list) {
 #endif
 }
 
-static inline uint64_t hash_str(const char *str) {
-    unsigned long hash = 5381;
-    int c;
-    while ((c = *str++))
-        hash = ((hash << 5) + hash) + c;
-    return hash;
-}
-
-static struct path_result_table init_table(uint64_t size) {
+static struct path_result_table init_table(uint64_t max_elements) {
     struct path_result_table table = {0};
-    table.table = calloc(sizeof(struct path_result_t*), size);
-    table.size = size;
+    table.size = 1024;
+    while (table.size < max_elements)
+        table.size *= 2;
+    table.table = calloc(sizeof(struct path_result_t*), table.size);
+    table.max_elements = max_elements;
     return table;
 }
 
-static void rehash_path(const char *path, const char *new) {
-    uint64_t hash = hash_str(path);
-    uint64_t offset = hash % echfs.path_cache.size;
+static void put_path(struct path_result_t *path_res) {
+    if (!__atomic_sub_fetch(&path_res->refs, 1, __ATOMIC_ACQ_REL)) {
+        free(path_res->orphan);
+        free(path_res->path);
+        free(path_res);
+    }
+}
 
-    struct path_result_t *element = echfs.path_cache.table[offset];
-    struct path_result_t *prev = NULL;
-    for (; element; prev = element, element = element->next) {
-        if (!strcmp(element->path, new)) {
-            if (!prev) {
-                echfs.path_cache.table[offset] = element->next;
-            } else {
-                prev->next = element->next;
-            }
+static void lru_unlink(struct path_result_t *path_res) {
+    if (path_res->lru_prev)
+        path_res->lru_prev->lru_next = path_res->lru_next;
+    else
+        echfs.path_cache.lru_head = path_res->lru_next;
+    if (path_res->lru_next)
+        path_res->lru_next->lru_prev = path_res->lru_prev;
+    else
+        echfs.path_cache.lru_tail = path_res->lru_prev;
+}
+
+static void lru_push(struct path_result_t *path_res) {
+    path_res->lru_prev = NULL;
+    path_res->lru_next = echfs.path_cache.lru_head;
+    if (echfs.path_cache.lru_head)
+        echfs.path_cache.lru_head->lru_prev = path_res;
+    else
+        echfs.path_cache.lru_tail = path_res;
+    echfs.path_cache.lru_head = path_res;
+}
+
+/* the cache functions below must be called with cache_lock held for
+ * writing, unless noted otherwise */
+static void insert_cached_path(struct path_result_t *path_res) {
+    uint64_t offset = path_res->hash % echfs.path_cache.size;
+    path_res->next = echfs.path_cache.table[offset];
+    echfs.path_cache.table[offset] = path_res;
+    if(detect_cycle(echfs.path_cache.table[offset]))
+        echfs_debug("detected cycle in insert_cached_path with path %s\n",
+                path_res->path);
+
+    lru_push(path_res);
+    echfs.path_cache.num_elements++;
+}
+
+/* unhooks the entry and drops the reference the cache held */
+static void unlink_cached_path(struct path_result_t *path_res) {
+    uint64_t offset = path_res->hash % echfs.path_cache.size;
+    struct path_result_t **link = &echfs.path_cache.table[offset];
+    for (; *link; link = &(*link)->next) {
+        if (*link == path_res) {
+            *link = path_res->next;
             break;
         }
     }
-    element->next = NULL;
-    if(detect_cycle(echfs.path_cache.table[offset]))
-        echfs_debug("detected cycle in rehash_path\n");
+    path_res->next = NULL;
 
-    uint64_t new_hash = hash_str(element->path);
-    uint64_t new_offset = new_hash % echfs.path_cache.size;
-    if (!echfs.path_cache.table[new_offset]) {
-        echfs.path_cache.table[new_offset] = element;
-    } else {
-        struct path_result_t *it = echfs.path_cache.table[new_offset];
-        for (; it->next; it = it->next);
-        it->next = element;
+    lru_unlink(path_res);
+    echfs.path_cache.num_elements--;
+    put_path(path_res);
+}
+
+static void evict_cached_paths() {
+    uint64_t budget = echfs.path_cache.num_elements * 2;
+    while (echfs.path_cache.num_elements >= echfs.path_cache.max_elements
+            && budget--) {
+        struct path_result_t *victim = echfs.path_cache.lru_tail;
+        if (__atomic_load_n(&victim->accessed, __ATOMIC_RELAXED) ||
+                __atomic_load_n(&victim->refs, __ATOMIC_ACQUIRE) > 1) {
+            __atomic_store_n(&victim->accessed, 0, __ATOMIC_RELAXED);
+            lru_unlink(victim);
+            lru_push(victim);
+            continue;
+        }
+        echfs_debug("evicting cached path %s\n", victim->path);
+        unlink_cached_path(victim);
     }
-    if(detect_cycle(echfs.path_cache.table[new_offset]))
-        echfs_debug("detected cycle in rehash_path\n");
 }
 
-static void remove_cached_path(const char *path) {
+/* callable with cache_lock held for reading */
+static struct path_result_t *lookup_cached_path(const char *path) {
     uint64_t hash = hash_str(path);
     uint64_t offset = hash % echfs.path_cache.size;
+    struct path_result_t *result = echfs.path_cache.table[offset];
+    for (; result; result = result->next) {
+        if (result->hash == hash && !strcmp(result->path, path))
+            return result;
+    }
+    return NULL;
+}
 
-    struct path_result_t *element = echfs.path_cache.table[offset];
-    struct path_result_t *prev = NULL;
-    for (; element; prev = element, element = element->next) {
-        if (!strcmp(element->path, path)) {
-            if (!prev) {
-                echfs.path_cache.table[offset] = element->next;
-                free(element);
-            } else {
-                prev->next = element->next;
-                free(element);
-            }
-            break;
+/* returns a new reference to the cached result, if any */
+static struct path_result_t *get_cached_path(const char *path) {
+    pthread_rwlock_rdlock(&echfs.cache_lock);
+    struct path_result_t *result = lookup_cached_path(path);
+    if (result) {
+        __atomic_add_fetch(&result->refs, 1, __ATOMIC_RELAXED);
+        if (!__atomic_load_n(&result->accessed, __ATOMIC_RELAXED))
+            __atomic_store_n(&result->accessed, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&echfs.cache_lock);
+    return result;
+}
+
+/*
+ * takes the caller's reference to path_res and returns a reference to the
+ * cached result, which may come from a racing resolver
+ */
+static struct path_result_t *cache_path(struct path_result_t *path_res) {
+    pthread_rwlock_wrlock(&echfs.cache_lock);
+    struct path_result_t *cached = lookup_cached_path(path_res->path);
+    if (cached) {
+        if (cached != path_res) {
+            __atomic_add_fetch(&cached->refs, 1, __ATOMIC_RELAXED);
+            put_path(path_res);
         }
+        pthread_rwlock_unlock(&echfs.cache_lock);
+        return cached;
     }
-    if(detect_cycle(echfs.path_cache.table[offset]))
-        echfs_debug("detected cycle in remove_cached_path with path %s\n",
-                path);
+
+    evict_cached_paths();
+    __atomic_add_fetch(&path_res->refs, 1, __ATOMIC_RELAXED);
+    insert_cached_path(path_res);
+    pthread_rwlock_unlock(&echfs.cache_lock);
+    return path_res;
 }
 
-static void insert_cached_path(struct path_result_t *path_res,
-        struct path_result_table *table) {
-    uint64_t hash = hash_str(path_res->path);
-    uint64_t offset = hash % table->size;
+static void remove_cached_path(const char *path) {
+    pthread_rwlock_wrlock(&echfs.cache_lock);
+    struct path_result_t *element = lookup_cached_path(path);
+    if (element)
+        unlink_cached_path(element);
+    pthread_rwlock_unlock(&echfs.cache_lock);
+}
 
-    if (!table->table[offset]) {
-        table->table[offset] = path_res;
-    } else {
-        struct path_result_t *element = table->table[offset];
-        for (; element->next; element = element->next);
-        element->next = path_res;
+/* drops everything cached below the directory at path */
+static void remove_cached_children(const char *path) {
+    size_t len = strlen(path);
+    pthread_rwlock_wrlock(&echfs.cache_lock);
+    struct path_result_t *element = echfs.path_cache.lru_head;
+    while (element) {
+        struct path_result_t *next = element->lru_next;
+        if (!strncmp(element->path, path, len) && element->path[len] == '/')
+            unlink_cached_path(element);
+        element = next;
     }
-    if(detect_cycle(table->table[offset]))
-        echfs_debug("detected cycle in insert_cached_path with path %s\n",
-                path_res->path);
+    pthread_rwlock_unlock(&echfs.cache_lock);
+}
 
-    table->num_elements++;
-}
-
-static void cache_path(struct path_result_t *path_res) {
-    double load_factor = (echfs.path_cache.num_elements + 1) /
-        echfs.path_cache.size;
-    if (load_factor > 0.75) {
-        echfs_debug("rehashing table!\n");
-        /* rehash */
-        struct path_result_table new_table = init_table(echfs.path_cache.size
-                * 2);
-        for (int i = 0; i < echfs.path_cache.size; i++) {
-            struct path_result_t *element = echfs.path_cache.table[i];
-            while (element) {
-                struct path_result_t *next = element->next;
-                element->next = NULL;
-                insert_cached_path(element, &new_table);
+/*
+ * moves path_res, and for a directory everything cached below it, to the
+ * new path. Failed lookups below the old path are dropped, since their
+ * parent no longer exists there.
+ */
+static void rename_cached_path(struct path_result_t *path_res,
+        const char *new) {
+    char *old = path_res->path;
+    size_t old_len = strlen(old), new_len = strlen(new);
+
+    pthread_rwlock_wrlock(&echfs.cache_lock);
+    struct path_result_t *stale = lookup_cached_path(new);
+    if (stale && stale != path_res)
+        unlink_cached_path(stale);
+
+    /* the reference taken here becomes the cache's again on reinsertion */
+    int cached = lookup_cached_path(old) == path_res;
+    if (cached) {
+        __atomic_add_fetch(&path_res->refs, 1, __ATOMIC_RELAXED);
+        unlink_cached_path(path_res);
+    }
+    path_res->path = strdup(new);
+    path_res->hash = hash_str(new);
+    if (cached)
+        insert_cached_path(path_res);
+
+    if (path_entry(path_res)->type == DIRECTORY_TYPE) {
+        struct path_result_t *element = echfs.path_cache.lru_head;
+        while (element) {
+            struct path_result_t *next = element->lru_next;
+            if (strncmp(element->path, old, old_len) ||
+                    element->path[old_len] != '/') {
                 element = next;
+                continue;
+            }
+
+            if (element->failure) {
+                unlink_cached_path(element);
+            } else {
+                const char *rest = element->path + old_len;
+                char *moved = malloc(new_len + strlen(rest) + 1);
+                strcpy(moved, new);
+                strcat(moved, rest);
+                __atomic_add_fetch(&element->refs, 1, __ATOMIC_RELAXED);
+                unlink_cached_path(element);
+                free(element->path);
+                element->path = moved;
+                element->hash = hash_str(moved);
+                insert_cached_path(element);
             }
+            element = next;
         }
-        free(echfs.path_cache.table);
-        echfs.path_cache = new_table;
     }
+    pthread_rwlock_unlock(&echfs.cache_lock);
+    free(old);
+}
 
-    insert_cached_path(path_res, &echfs.path_cache);
+/* inode numbers follow the slots, past the kernel's number for the root */
+static inline uint64_t slot_ino(uint64_t slot) {
+    return slot == ROOT_ID ? FUSE_ROOT_ID : slot + 2;
 }
 
-static struct path_result_t *get_cached_path(const char *path) {
-    uint64_t hash = hash_str(path);
-    uint64_t offset = hash % echfs.path_cache.size;
-    struct path_result_t *result = echfs.path_cache.table[offset];
-    for (; result; result = result->next) {
-        if (!strcmp(result->path, path)) return result;
+static inline uint64_t hash_ino(uint64_t ino) {
+    return ((ino * 0x9e3779b97f4a7c15) >> 32) & echfs.inodes.mask;
+}
+
+/* the inode table functions must be called with cache_lock held for
+ * writing, unless noted otherwise */
+static void inode_link_slot(struct path_result_t *inode) {
+    uint64_t bucket = hash_ino(inode->target_entry);
+    inode->slot_next = echfs.inodes.by_slot[bucket];
+    echfs.inodes.by_slot[bucket] = inode;
+}
+
+static void inode_link(struct path_result_t *inode) {
+    uint64_t bucket = hash_ino(inode->ino);
+    inode->ino_next = echfs.inodes.by_ino[bucket];
+    echfs.inodes.by_ino[bucket] = inode;
+    if (!inode->failure)
+        inode_link_slot(inode);
+}
+
+/* rebuilds the slot chains, after compaction moved the entries */
+static void inode_index_slots() {
+    memset(echfs.inodes.by_slot, 0,
+            (echfs.inodes.mask + 1) * sizeof(struct path_result_t *));
+    for (uint64_t i = 0; i <= echfs.inodes.mask; i++) {
+        struct path_result_t *inode = echfs.inodes.by_ino[i];
+        for (; inode; inode = inode->ino_next) {
+            if (!inode->failure)
+                inode_link_slot(inode);
+        }
     }
-    return NULL;
 }
 
-static void *echfs_init(struct fuse_conn_info *conn) {
-    (void) conn;
+/* on failure the table just keeps its size */
+static void inode_grow() {
+    uint64_t size = (echfs.inodes.mask + 1) * 2;
+    struct path_result_t **by_ino = calloc(size, sizeof(*by_ino));
+    struct path_result_t **by_slot = calloc(size, sizeof(*by_slot));
+    if (!by_ino || !by_slot) {
+        free(by_ino);
+        free(by_slot);
+        return;
+    }
 
-    memset(&handles, 0, sizeof(handles));
-    echfs.image = fopen(echfs.image_path, "r+");
-    if (!echfs.image) {
-        fprintf(stderr, "Error opening echfs image %s!\n", echfs.image_path);
-        cleanup_fuse();
-        exit(1);
+    struct path_result_t **old = echfs.inodes.by_ino;
+    uint64_t old_size = echfs.inodes.mask + 1;
+    free(echfs.inodes.by_slot);
+    echfs.inodes.by_ino = by_ino;
+    echfs.inodes.by_slot = by_slot;
+    echfs.inodes.mask = size - 1;
+    for (uint64_t i = 0; i < old_size; i++) {
+        struct path_result_t *inode = old[i];
+        while (inode) {
+            struct path_result_t *next = inode->ino_next;
+            inode_link(inode);
+            inode = next;
+        }
     }
+    free(old);
+}
 
-    if (echfs.mbr) {
-        struct part p;
-        mbr_get_part(&p, echfs.image, echfs.partition);
-        echfs.part_offset = p.first_sect * 512;
+/* callable with cache_lock held for reading */
+static struct path_result_t *inode_find(uint64_t ino) {
+    struct path_result_t *inode = echfs.inodes.by_ino[hash_ino(ino)];
+    for (; inode; inode = inode->ino_next) {
+        if (inode->ino == ino)
+            return inode;
+    }
+    return NULL;
+}
+
+/* the inode of the live entry in a slot, callable with cache_lock held for
+ * reading */
+static struct path_result_t *inode_at(uint64_t slot) {
+    struct path_result_t *inode = echfs.inodes.by_slot[hash_ino(slot)];
+    for (; inode; inode = inode->slot_next) {
+        if (inode->target_entry == slot)
+            return inode;
+    }
+    return NULL;
+}
+
+static void inode_unlink_slot(struct path_result_t *inode) {
+    struct path_result_t **link =
+        &echfs.inodes.by_slot[hash_ino(inode->target_entry)];
+    for (; *link; link = &(*link)->slot_next) {
+        if (*link == inode) {
+            *link = inode->slot_next;
+            return;
+        }
+    }
+}
+
+static void inode_unlink(struct path_result_t *inode) {
+    struct path_result_t **link = &echfs.inodes.by_ino[hash_ino(inode->ino)];
+    for (; *link; link = &(*link)->ino_next) {
+        if (*link == inode) {
+            *link = inode->ino_next;
+            break;
+        }
+    }
+    if (!inode->failure)
+        inode_unlink_slot(inode);
+}
+
+static int init_inodes() {
+    echfs.inodes.mask = 1023;
+    echfs.inodes.by_ino = calloc(1024, sizeof(struct path_result_t *));
+    echfs.inodes.by_slot = calloc(1024, sizeof(struct path_result_t *));
+    struct path_result_t *root = calloc(1, sizeof(struct path_result_t));
+    if (!echfs.inodes.by_ino || !echfs.inodes.by_slot || !root) {
+        free(root);
+        return -1;
+    }
+
+    /* the kernel never forgets the root */
+    root->target_entry = root->parent_id = ROOT_ID;
+    root->ino = FUSE_ROOT_ID;
+    root->nlookup = root->refs = 1;
+    inode_link(root);
+    echfs.inodes.num_elements = 1;
+    return 0;
+}
+
+/* returns a new reference to a known inode */
+static struct path_result_t *get_inode(uint64_t ino) {
+    pthread_rwlock_rdlock(&echfs.cache_lock);
+    struct path_result_t *inode = inode_find(ino);
+    if (inode)
+        __atomic_add_fetch(&inode->refs, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&echfs.cache_lock);
+    return inode;
+}
+
+/*
+ * counts a lookup of the entry in a slot by the kernel, creating its inode
+ * on the first one. The inode stays valid until the kernel forgets the
+ * lookup. Must be called with dir_lock held.
+ */
+static struct path_result_t *lookup_inode(uint64_t slot) {
+    pthread_rwlock_wrlock(&echfs.cache_lock);
+    struct path_result_t *inode = inode_at(slot);
+    if (!inode) {
+        inode = calloc(1, sizeof(struct path_result_t));
+        if (!inode) {
+            pthread_rwlock_unlock(&echfs.cache_lock);
+            return NULL;
+        }
+        inode->target_entry = slot;
+        inode->parent_id = echfs.dir_table[slot].parent_id;
+        inode->refs = 1;
+        /* a deleted entry's inode may still hold the slot's number */
+        inode->ino = slot_ino(slot);
+        while (inode_find(inode->ino))
+            inode->ino += 1ull << 48;
+        inode_link(inode);
+        if (++echfs.inodes.num_elements > echfs.inodes.mask + 1)
+            inode_grow();
+    }
+    inode->nlookup++;
+    pthread_rwlock_unlock(&echfs.cache_lock);
+    return inode;
+}
+
+static void forget_inode(uint64_t ino, uint64_t nlookup) {
+    pthread_rwlock_wrlock(&echfs.cache_lock);
+    struct path_result_t *inode = inode_find(ino);
+    if (inode && ino != FUSE_ROOT_ID) {
+        inode->nlookup -= nlookup < inode->nlookup ? nlookup : inode->nlookup;
+        if (!inode->nlookup) {
+            inode_unlink(inode);
+            echfs.inodes.num_elements--;
+            put_path(inode);
+        }
+    }
+    pthread_rwlock_unlock(&echfs.cache_lock);
+}
+
+/*
+ * returns a reference to the inode of the entry in a slot, or sets up
+ * `stray` in its place when the kernel has not looked the entry up. Must
+ * be called with dir_lock held.
+ */
+static struct path_result_t *get_slot_inode(uint64_t slot,
+        struct path_result_t *stray) {
+    pthread_rwlock_rdlock(&echfs.cache_lock);
+    struct path_result_t *inode = inode_at(slot);
+    if (inode)
+        __atomic_add_fetch(&inode->refs, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&echfs.cache_lock);
+    if (inode)
+        return inode;
+
+    memset(stray, 0, sizeof(struct path_result_t));
+    stray->target_entry = slot;
+    stray->parent_id = echfs.dir_table[slot].parent_id;
+    stray->refs = 1;
+    return stray;
+}
+
+/* drops a reference from get_slot_inode(), after making the inode stale if
+ * its entry was deleted. Must be called with dir_lock held for writing. */
+static void put_slot_inode(struct path_result_t *inode,
+        struct path_result_t *stray, int deleted) {
+    if (inode == stray) {
+        free(stray->orphan);
+        return;
+    }
+    if (deleted) {
+        pthread_rwlock_wrlock(&echfs.cache_lock);
+        inode_unlink_slot(inode);
+        inode->failure = 1;
+        pthread_rwlock_unlock(&echfs.cache_lock);
+    }
+    put_path(inode);
+}
+
+static inline int block_in_use(uint64_t block) {
+    return (echfs.free_map[block / 64] >> (block % 64)) & 1;
+}
+
+static inline void mark_block(uint64_t block, int used) {
+    if (used)
+        echfs.free_map[block / 64] |= (uint64_t)1 << (block % 64);
+    else
+        echfs.free_map[block / 64] &= ~((uint64_t)1 << (block % 64));
+}
+
+static int build_free_map() {
+    uint64_t words = (echfs.blocks + 63) / 64;
+    echfs.free_map = calloc(words, sizeof(uint64_t));
+    if (!echfs.free_map)
+        return -1;
+
+    echfs.free_blocks = 0;
+    for (uint64_t i = 0; i < words * 64; i++) {
+        if (i < echfs.data_start || i >= echfs.blocks || echfs.fat[i])
+            mark_block(i, 1);
+        else
+            echfs.free_blocks++;
+    }
+    echfs.alloc_cursor = echfs.data_start;
+    return 0;
+}
+
+/* returns the first free block in [from, echfs.blocks), skipping full words */
+static uint64_t find_free_block(uint64_t from) {
+    uint64_t words = (echfs.blocks + 63) / 64;
+    uint64_t word = from / 64;
+    if (word >= words)
+        return SEARCH_FAILURE;
+
+    uint64_t bits = ~echfs.free_map[word] & (~(uint64_t)0 << (from % 64));
+    while (!bits) {
+        if (++word >= words)
+            return SEARCH_FAILURE;
+        bits = ~echfs.free_map[word];
+    }
+    return word * 64 + __builtin_ctzll(bits);
+}
+
+/* finds a free run of at most max_len blocks, searching from the cursor and
+ * wrapping around once */
+static uint64_t find_free_run(uint64_t from, uint64_t max_len, uint64_t *len) {
+    uint64_t start = find_free_block(from);
+    if (start == SEARCH_FAILURE)
+        start = find_free_block(echfs.data_start);
+    if (start == SEARCH_FAILURE)
+        return SEARCH_FAILURE;
+
+    uint64_t n = 1;
+    while (n < max_len && start + n < echfs.blocks && !block_in_use(start + n))
+        n++;
+    *len = n;
+    return start;
+}
+
+/* frees the chain starting at block, must be called with fat_lock held */
+static void release_chain(uint64_t block) {
+    /* a corrupt chain ends at anything outside the data area; a cycle comes
+     * back to a block already freed here, whose entry is now 0 */
+    while (block >= echfs.data_start && block < echfs.blocks) {
+        uint64_t next_block = echfs.fat[block];
+        wr_fat(block, 0);
+        mark_block(block, 0);
+        echfs.free_blocks++;
+        block = next_block;
+    }
+}
+
+/* writes back the dirty blocks of a table, merging consecutive ones */
+static int write_back(uint64_t *dirty, uint64_t blocks, void *table,
+        uint64_t start) {
+    int ret = 0;
+    for (uint64_t i = 0; i < blocks; ) {
+        if (!dirty[i / 64]) {
+            i += 64 - (i % 64);
+            continue;
+        }
+        if (!is_dirty(dirty, i)) {
+            i++;
+            continue;
+        }
+
+        uint64_t run = 1;
+        while (i + run < blocks && is_dirty(dirty, i + run))
+            run++;
+
+        uint64_t loc = (start + i) * echfs.bytes_per_block;
+        int failed;
+        if (echfs.map) {
+            /* msync wants a page aligned address */
+            uint64_t page_size = sysconf(_SC_PAGESIZE);
+            uint64_t map_loc = loc + echfs.map_delta;
+            uint64_t align = map_loc % page_size;
+            failed = msync(echfs.map - echfs.map_delta + map_loc - align,
+                    run * echfs.bytes_per_block + align, MS_SYNC);
+        } else {
+            failed = echfs_pwrite((uint8_t *)table + i * echfs.bytes_per_block,
+                    run * echfs.bytes_per_block, loc);
+        }
+
+        /* blocks that didn't make it stay dirty for the next flush */
+        if (failed) {
+            ret = -EIO;
+        } else {
+            for (uint64_t j = i; j < i + run; j++)
+                dirty[j / 64] &= ~((uint64_t)1 << (j % 64));
+        }
+        i += run;
+    }
+    return ret;
+}
+
+/*
+ * writes every dirty data, directory and allocation table block to the
+ * image. Data goes out first, but writers don't wait for a flush, so a
+ * write landing in between can still leave the metadata ahead of the
+ * data on disk; this is no crash consistency guarantee.
+ */
+static int flush_metadata() {
+    pthread_mutex_lock(&echfs.flush_lock);
+
+    int data_ret = flush_block_cache();
+
+    pthread_rwlock_rdlock(&echfs.dir_lock);
+    int ret = write_back(echfs.dir_dirty, echfs.dir_size, echfs.dir_table,
+            echfs.dir_start);
+    pthread_rwlock_unlock(&echfs.dir_lock);
+
+    pthread_rwlock_rdlock(&echfs.fat_lock);
+    int fat_ret = write_back(echfs.fat_dirty, echfs.fat_size, echfs.fat,
+            echfs.fat_start);
+    pthread_rwlock_unlock(&echfs.fat_lock);
+
+    pthread_mutex_unlock(&echfs.flush_lock);
+    if (data_ret)
+        return data_ret;
+    return ret ? ret : fat_ret;
+}
+
+/*
+ * rewrites the directory without its deleted entries once they make up a
+ * quarter of it, keeping the entries of each directory together. Slots
+ * move, so the path cache and the open file lists are remapped; nothing
+ * is done while a directory is open, as readdir cookies are slots. Must
+ * be called with handles_lock and dir_lock held for writing.
+ */
+static int compact_dir() {
+    uint64_t end = echfs.dir_index.end;
+    uint64_t live = echfs.dir_index.num_elements;
+    if (end - live < 64 || (end - live) * 4 < end)
+        return 0;
+    for (int i = 0; i < MAX_HANDLES; i++) {
+        if (handles[i].occupied &&
+                path_entry(handles[i].path_res)->type == DIRECTORY_TYPE)
+            return 0;
+    }
+
+    struct entry_t *old = malloc(end * sizeof(struct entry_t));
+    uint64_t *remap = malloc(end * sizeof(uint64_t));
+    if (!old || !remap) {
+        free(old);
+        free(remap);
+        return -ENOMEM;
+    }
+    memcpy(old, echfs.dir_table, end * sizeof(struct entry_t));
+
+    /* the child lists already have the entries grouped by parent */
+    uint64_t count = 0;
+    for (uint64_t i = 0; i <= echfs.dir_index.dirs_mask; i++) {
+        struct dir_children *dir = echfs.dir_index.dirs[i];
+        for (; dir; dir = dir->next) {
+            for (uint64_t j = 0; j < dir->count; j++) {
+                remap[dir->slots[j]] = count;
+                echfs.dir_table[count++] = old[dir->slots[j]];
+            }
+        }
+    }
+    memset(echfs.dir_table + count, 0, (end - count) * sizeof(struct entry_t));
+
+    struct dir_index saved = echfs.dir_index;
+    memset(&echfs.dir_index, 0, sizeof(struct dir_index));
+    if (build_dir_index()) {
+        free_dir_index(&echfs.dir_index);
+        memcpy(echfs.dir_table, old, end * sizeof(struct entry_t));
+        echfs.dir_index = saved;
+        free(old);
+        free(remap);
+        return -ENOMEM;
+    }
+    if (saved.next_dir_id > echfs.dir_index.next_dir_id)
+        echfs.dir_index.next_dir_id = saved.next_dir_id;
+    echfs.dir_index.free_dir_ids = saved.free_dir_ids;
+    echfs.dir_index.free_dir_count = saved.free_dir_count;
+    echfs.dir_index.free_dir_capacity = saved.free_dir_capacity;
+    free_dir_index(&saved);
+
+    for (uint64_t i = 0; i < end; i += echfs.entries_per_block)
+        mark_dirty(echfs.dir_dirty, i / echfs.entries_per_block);
+
+    pthread_rwlock_wrlock(&echfs.cache_lock);
+    struct path_result_t *path_res = echfs.path_cache.lru_head;
+    for (; path_res; path_res = path_res->lru_next) {
+        if (!path_res->failure && !path_res->orphan &&
+                path_res->target_entry != ROOT_ID)
+            path_res->target_entry = remap[path_res->target_entry];
+    }
+    if (echfs.lowlevel) {
+        for (uint64_t i = 0; i <= echfs.inodes.mask; i++) {
+            struct path_result_t *inode = echfs.inodes.by_ino[i];
+            for (; inode; inode = inode->ino_next) {
+                if (!inode->failure && inode->target_entry != ROOT_ID)
+                    inode->target_entry = remap[inode->target_entry];
+            }
+        }
+        inode_index_slots();
+    }
+    pthread_rwlock_unlock(&echfs.cache_lock);
+    for (struct extent_map *map = open_files; map; map = map->next) {
+        if (map->entry != SEARCH_FAILURE)
+            map->entry = remap[map->entry];
+    }
+
+    echfs_debug("compacted %lu directory entries into %lu\n", end, count);
+    free(old);
+    free(remap);
+    return 0;
+}
+
+static void compact_locked() {
+    pthread_rwlock_wrlock(&handles_lock);
+    pthread_rwlock_wrlock(&echfs.dir_lock);
+    if (compact_dir())
+        fprintf(stderr, "warning: couldn't compact the directory!\n");
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    pthread_rwlock_unlock(&handles_lock);
+}
+
+static void *writeback_worker(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&echfs.writeback_mutex);
+    while (!echfs.writeback_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += echfs.flush_interval;
+        pthread_cond_timedwait(&echfs.writeback_cond, &echfs.writeback_mutex,
+                &deadline);
+        if (echfs.writeback_stop)
+            break;
+
+        pthread_mutex_unlock(&echfs.writeback_mutex);
+        if (echfs.compact)
+            compact_locked();
+        if (flush_metadata())
+            fprintf(stderr, "error writing back metadata!\n");
+        pthread_mutex_lock(&echfs.writeback_mutex);
+    }
+    pthread_mutex_unlock(&echfs.writeback_mutex);
+    return NULL;
+}
+
+static void stop_writeback() {
+    if (!echfs.writeback_running)
+        return;
+    pthread_mutex_lock(&echfs.writeback_mutex);
+    echfs.writeback_stop = 1;
+    pthread_cond_signal(&echfs.writeback_cond);
+    pthread_mutex_unlock(&echfs.writeback_mutex);
+    pthread_join(echfs.writeback_thread, NULL);
+    echfs.writeback_running = 0;
+}
+
+static void free_tables() {
+    if (echfs.map) {
+        munmap(echfs.map - echfs.map_delta,
+                echfs.image_size + echfs.map_delta);
+        echfs.map = NULL;
+    } else {
+        free(echfs.dir_table);
+        free(echfs.fat);
+    }
+    free(echfs.free_map);
+    free(echfs.dir_dirty);
+    free(echfs.fat_dirty);
+    free_dir_index(&echfs.dir_index);
+    free(echfs.dir_index.free_dir_ids);
+}
+
+static void *echfs_init(struct fuse_conn_info *conn) {
+    /* writes come in requests of up to max_write instead of a page each */
+    if (conn->capable & FUSE_CAP_BIG_WRITES)
+        conn->want |= FUSE_CAP_BIG_WRITES;
+    /* let file data move between the image and /dev/fuse through pipes,
+     * unless it has to go through the block cache */
+    if (!echfs.cache_size)
+        conn->want |= conn->capable &
+            (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE);
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+    if (echfs.writeback_cache && (conn->capable & FUSE_CAP_WRITEBACK_CACHE))
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+#endif
+
+    memset(&handles, 0, sizeof(handles));
+    pthread_rwlock_init(&handles_lock, NULL);
+    pthread_rwlock_init(&echfs.dir_lock, NULL);
+    pthread_rwlock_init(&echfs.cache_lock, NULL);
+    pthread_rwlock_init(&echfs.fat_lock, NULL);
+    pthread_mutex_init(&echfs.flush_lock, NULL);
+
+    echfs.image = fopen(echfs.image_path, "r+");
+    if (!echfs.image) {
+        fprintf(stderr, "Error opening echfs image %s!\n", echfs.image_path);
+        cleanup_fuse();
+        exit(1);
+    }
+
+    if (echfs.mbr) {
+        struct part p;
+        mbr_get_part(&p, echfs.image, echfs.partition);
+        echfs.part_offset = p.first_sect * 512;
         echfs.image_size  = p.sect_count * 512;
     } else if (echfs.gpt) {
         struct part p;
@@ -338,14 +1734,13 @@ static void *echfs_init(struct fuse_conn_info *conn) {
         echfs.part_offset = 0;
         fseek(echfs.image, 0L, SEEK_END);
         echfs.image_size = (uint64_t)ftell(echfs.image);
-        echfs_fseek(echfs.image, 0L, SEEK_SET);
     }
+    echfs.fd = fileno(echfs.image);
     echfs_debug("echfs image size: %lu\n", echfs.image_size);
 
     char signature[8] = {0};
-    echfs_fseek(echfs.image, 4, SEEK_SET);
-    int ret = fread(signature, 8, 1, echfs.image);
-    if (ret != 1) {
+    int ret = echfs_pread(signature, 8, 4);
+    if (ret) {
         fprintf(stderr, "error reading signature!\n");
         cleanup_fuse();
         fclose(echfs.image);
@@ -400,148 +1795,209 @@ static void *echfs_init(struct fuse_conn_info *conn) {
     echfs_debug("image is %s\n", rd_word(510) == 0xAA55 ? "bootable" :
             "NOT bootable");
 
-    echfs.path_cache = init_table(1024);
-    echfs.dir_table = malloc(echfs.dir_size * echfs.bytes_per_block);
-    if (!echfs.dir_table) {
-        fprintf(stderr, "error allocating dir_table!\n");
+    echfs.path_cache = init_table(echfs.path_cache_size);
+    if (echfs.lowlevel && init_inodes()) {
+        fprintf(stderr, "error allocating inode table!\n");
         cleanup_fuse();
         fclose(echfs.image);
         exit(1);
     }
-    echfs_fseek(echfs.image, echfs.dir_start * echfs.bytes_per_block, SEEK_SET);
-    ret = fread(echfs.dir_table, sizeof(char), echfs.dir_size *
-            echfs.bytes_per_block, echfs.image);
-    if (ret != (echfs.dir_size * echfs.bytes_per_block)) {
-        fprintf(stderr, "error reading dir_table!\n");
+    if (echfs.use_mmap) {
+        if (map_image()) {
+            fprintf(stderr, "error mapping echfs image!\n");
+            cleanup_fuse();
+            fclose(echfs.image);
+            exit(1);
+        }
+        echfs.dir_table = (struct entry_t *)(echfs.map +
+                echfs.dir_start * echfs.bytes_per_block);
+        echfs.fat = (uint64_t *)(echfs.map +
+                echfs.fat_start * echfs.bytes_per_block);
+    } else {
+        echfs.dir_table = malloc(echfs.dir_size * echfs.bytes_per_block);
+        if (!echfs.dir_table) {
+            fprintf(stderr, "error allocating dir_table!\n");
+            cleanup_fuse();
+            fclose(echfs.image);
+            exit(1);
+        }
+        ret = echfs_pread(echfs.dir_table, echfs.dir_size * echfs.bytes_per_block,
+                echfs.dir_start * echfs.bytes_per_block);
+        if (ret) {
+            fprintf(stderr, "error reading dir_table!\n");
+            cleanup_fuse();
+            fclose(echfs.image);
+            free_tables();
+            exit(1);
+        }
+
+        echfs.fat = malloc(echfs.fat_size * echfs.bytes_per_block);
+        if (!echfs.fat) {
+            fprintf(stderr, "error allocating allocation table!\n");
+            cleanup_fuse();
+            fclose(echfs.image);
+            free_tables();
+            exit(1);
+        }
+        ret = echfs_pread(echfs.fat, echfs.fat_size * echfs.bytes_per_block,
+                echfs.fat_start * echfs.bytes_per_block);
+        if (ret) {
+            fprintf(stderr, "error reading allocation table!\n");
+            cleanup_fuse();
+            fclose(echfs.image);
+            free_tables();
+            exit(1);
+        }
+    }
+
+    if (build_free_map()) {
+        fprintf(stderr, "error allocating free block map!\n");
         cleanup_fuse();
         fclose(echfs.image);
-        free(echfs.dir_table);
+        free_tables();
         exit(1);
     }
 
-    echfs.fat = malloc(echfs.fat_size * echfs.bytes_per_block);
-    if (!echfs.fat) {
-        fprintf(stderr, "error allocating allocation table!\n");
+    if (build_dir_index()) {
+        fprintf(stderr, "error allocating directory index!\n");
         cleanup_fuse();
         fclose(echfs.image);
-        free(echfs.dir_table);
+        free_tables();
         exit(1);
     }
-    echfs_fseek(echfs.image, echfs.fat_start * echfs.bytes_per_block, SEEK_SET);
-    ret = fread(echfs.fat, sizeof(char), echfs.fat_size * echfs.bytes_per_block,
-            echfs.image);
-    if (ret != (echfs.fat_size * echfs.bytes_per_block)) {
-        fprintf(stderr, "error reading allocation table!\n");
+
+    echfs.dir_dirty = calloc((echfs.dir_size + 63) / 64, sizeof(uint64_t));
+    echfs.fat_dirty = calloc((echfs.fat_size + 63) / 64, sizeof(uint64_t));
+    if (!echfs.dir_dirty || !echfs.fat_dirty) {
+        fprintf(stderr, "error allocating dirty block maps!\n");
         cleanup_fuse();
         fclose(echfs.image);
-        free(echfs.dir_table);
-        free(echfs.fat);
+        free_tables();
         exit(1);
     }
 
+    if (echfs.cache_size && init_block_cache()) {
+        fprintf(stderr, "warning: couldn't allocate the block cache, "
+                "running without it\n");
+        free_block_cache();
+        echfs.cache_size = 0;
+    }
+
+    if (echfs.compact)
+        compact_locked();
+
+    if (echfs.flush_interval) {
+        pthread_mutex_init(&echfs.writeback_mutex, NULL);
+        pthread_cond_init(&echfs.writeback_cond, NULL);
+        echfs.writeback_stop = 0;
+        if (!pthread_create(&echfs.writeback_thread, NULL, writeback_worker,
+                    NULL))
+            echfs.writeback_running = 1;
+        else
+            fprintf(stderr, "warning: couldn't start metadata write-back, "
+                    "changes are only written on fsync and unmount\n");
+    }
+
     return NULL;
 }
 
 static void echfs_destroy(void *data) {
     (void) data;
     fprintf(stderr, "cleaning up!\n");
-    echfs_fseek(echfs.image, echfs.dir_start * echfs.bytes_per_block, SEEK_SET);
-    fwrite(echfs.dir_table, sizeof(char), echfs.dir_size * echfs.bytes_per_block,
-            echfs.image);
-    free(echfs.dir_table);
-
-    echfs_fseek(echfs.image, echfs.fat_start * echfs.bytes_per_block, SEEK_SET);
-    fwrite(echfs.fat, sizeof(char), echfs.dir_size * echfs.bytes_per_block,
-            echfs.image);
-    free(echfs.fat);
+    stop_writeback();
+    if (flush_metadata())
+        fprintf(stderr, "error writing back metadata!\n");
+    if (echfs.cache_size) {
+        uint64_t hits = 0, misses = 0;
+        for (int i = 0; i < CACHE_SHARDS; i++) {
+            hits += block_cache[i].hits;
+            misses += block_cache[i].misses;
+        }
+        fprintf(stderr, "block cache: %lu hits, %lu misses\n", hits, misses);
+        free_block_cache();
+    }
+    if (echfs.map)
+        msync(echfs.map - echfs.map_delta,
+                echfs.image_size + echfs.map_delta, MS_SYNC);
+    free_tables();
     fclose(echfs.image);
+
+    pthread_rwlock_destroy(&handles_lock);
+    pthread_rwlock_destroy(&echfs.dir_lock);
+    pthread_rwlock_destroy(&echfs.cache_lock);
+    pthread_rwlock_destroy(&echfs.fat_lock);
+    pthread_mutex_destroy(&echfs.flush_lock);
 }
 
 static int is_dir_empty(uint64_t id) {
-    for (uint64_t i = 0; i < (echfs.dir_size * echfs.entries_per_block); i++) {
-        struct entry_t *entry = &echfs.dir_table[i];
-        if (!entry->parent_id) return 1;
-        if (entry->parent_id == id) return 0;
-    }
-
-    return 1;
+    return !find_children(id);
 }
 
 static uint64_t search(const char *name, uint64_t parent) {
-    for (uint64_t i = 0; i < (echfs.dir_size * echfs.entries_per_block); i++) {
-        struct entry_t *entry = &echfs.dir_table[i];
-        if (!entry->parent_id) return SEARCH_FAILURE;
-        if ((entry->parent_id == parent) && (!strcmp(entry->name, name))) {
-            return i;
-        }
-    }
-    return SEARCH_FAILURE;
+    return index_lookup(name, parent);
 }
 
+/*
+ * returns a reference to the result, which the caller drops with put_path().
+ * Failures are cached too when only the last component is missing.
+ */
 static struct path_result_t *resolve_path(const char *path) {
     struct path_result_t *path_result = get_cached_path(path);
     if (path_result) {
         echfs_debug("found cached path %s\n", path);
-        path_result->failure = 0;
         return path_result;
     }
 
-    path_result = malloc(sizeof(struct path_result_t));
-    path_result->next = NULL;
-    strcpy(path_result->path, path);
-    path_result->type = DIRECTORY_TYPE;
+    path_result = calloc(1, sizeof(struct path_result_t));
+    path_result->path = strdup(path);
+    path_result->hash = hash_str(path);
+    path_result->refs = 1;
+    path_result->parent_id = ROOT_ID;
+    path_result->target_entry = ROOT_ID;
 
-    path_result->parent.payload = ROOT_ID;
-
-    if (!strncmp(path, "/\0", 2)) {
-        strncpy(path_result->name, "/\0", 2);
-        path_result->failure = 0;
-        path_result->target_entry = -1;
-        path_result->target.parent_id = -1;
-        path_result->target.type = DIRECTORY_TYPE;
-        strncpy(path_result->target.name, "/\0", 2);
-        path_result->target.payload = ROOT_ID;
-        return path_result;
-    }
+    if (!strncmp(path, "/\0", 2))
+        return cache_path(path_result);
 
     if (*path == '/') path++;
 
-    struct entry_t entry;
-    path_result->target.payload = ROOT_ID;
+    uint64_t dir_id = ROOT_ID;
     do {
         const char *seg = path;
         path = internal_strchrnul(path, '/');
         size_t seg_length = path - seg;
         if (seg[seg_length - 1] == '/')
             seg_length--;
-        char *seg_buf = malloc(seg_length + 1);
-        strncpy(seg_buf, seg, seg_length);
+        if (seg_length >= FILENAME_LEN) {
+            path_result->failure = 1;
+            return path_result;
+        }
+        char seg_buf[FILENAME_LEN];
+        memcpy(seg_buf, seg, seg_length);
         seg_buf[seg_length] = '\0';
         echfs_debug("resolve_path(): looking for %s\n", seg_buf);
 
-        uint64_t search_res = search(seg_buf, path_result->target.payload);
+        uint64_t search_res = search(seg_buf, dir_id);
+        path_result->parent_id = dir_id;
         if (search_res == SEARCH_FAILURE) {
             echfs_debug("resolve_path(): search failure for %s\n", seg_buf);
-            strcpy(path_result->name, seg_buf);
-            path_result->parent = path_result->target;
             path_result->failure = 1;
-            free(seg_buf);
-            return path_result;
+            if (*path)
+                return path_result;
+            return cache_path(path_result);
         }
 
-        rd_entry(&entry, search_res);
-        path_result->parent = path_result->target;
-        path_result->target = entry;
+        struct entry_t *entry = &echfs.dir_table[search_res];
         path_result->target_entry = search_res;
         echfs_debug("resolve_path(): found %s\n", seg_buf);
-        free(seg_buf);
+        if (*path && entry->type != DIRECTORY_TYPE) {
+            echfs_debug("resolve_path(): %s is not a directory\n", seg_buf);
+            path_result->failure = 1;
+            return path_result;
+        }
+        dir_id = entry->payload;
     } while (*path);
 
-    strcpy(path_result->name, entry.name);
-    path_result->type = path_result->target.type;
-    path_result->failure = 0;
-    cache_path(path_result);
-    return path_result;
+    return cache_path(path_result);
 }
 
 static int get_handle() {
@@ -551,80 +2007,259 @@ static int get_handle() {
     return -1;
 }
 
-static int echfs_open(const char *file_path, struct fuse_file_info *file_info) {
-    echfs_debug("opening file %s\n", file_path);
-    struct path_result_t *path_result = resolve_path(file_path);
-    if (path_result->failure) return -ENOENT;
-    if (path_result->target.type == DIRECTORY_TYPE) return -EISDIR;
+/* makes room for `count` more extents */
+static int extent_reserve(struct extent_map *map, uint64_t count) {
+    if (map->count + count <= map->capacity)
+        return 0;
+    uint64_t capacity = map->capacity ? map->capacity * 2 : 4;
+    if (capacity < map->count + count)
+        capacity = map->count + count;
+    struct extent_t *extents = realloc(map->extents,
+            capacity * sizeof(struct extent_t));
+    if (!extents)
+        return -ENOMEM;
+    map->extents = extents;
+    map->capacity = capacity;
+    return 0;
+}
+
+/* appends `length` physical blocks from `block` on as the next logical
+ * blocks of the file */
+static int extent_append(struct extent_map *map, uint64_t block,
+        uint64_t length) {
+    struct extent_t *last = map->count ? &map->extents[map->count - 1] : NULL;
+    if (last && last->start + last->length == block) {
+        last->length += length;
+        map->total_blocks += length;
+        return 0;
+    }
+
+    if (extent_reserve(map, 1))
+        return -ENOMEM;
+    map->extents[map->count].logical = map->total_blocks;
+    map->extents[map->count].start = block;
+    map->extents[map->count].length = length;
+    map->count++;
+    map->total_blocks += length;
+    return 0;
+}
+
+/*
+ * finds the physical block backing logical block `block`, and in *run the
+ * number of physically consecutive blocks starting there. Fails past the
+ * end of the chain, which an entry claiming more bytes than its chain
+ * holds would otherwise point into other files.
+ */
+static int extent_lookup(const struct extent_map *map, uint64_t block,
+        uint64_t *start, uint64_t *run) {
+    if (block >= map->total_blocks || !map->count)
+        return -EIO;
+
+    uint64_t lo = 0, hi = map->count;
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (map->extents[mid].logical <= block)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    const struct extent_t *extent = &map->extents[lo];
+    if (block - extent->logical >= extent->length)
+        return -EIO;
+    *run = extent->length - (block - extent->logical);
+    *start = extent->start + (block - extent->logical);
+    return 0;
+}
+
+/* drops the logical blocks from `blocks` on */
+static void extent_trim(struct extent_map *map, uint64_t blocks) {
+    while (map->count && map->extents[map->count - 1].logical >= blocks)
+        map->count--;
+    if (map->count) {
+        struct extent_t *last = &map->extents[map->count - 1];
+        if (last->logical + last->length > blocks)
+            last->length = blocks - last->logical;
+    }
+    if (map->total_blocks > blocks)
+        map->total_blocks = blocks;
+}
+
+/* must be called with handles_lock held for writing */
+static struct extent_map *get_extents(struct path_result_t *path_res) {
+    struct extent_map *map;
+    for (map = open_files; map; map = map->next) {
+        if (map->entry == path_res->target_entry) {
+            map->refs++;
+            return map;
+        }
+    }
+
+    map = calloc(1, sizeof(struct extent_map));
+    if (!map)
+        return NULL;
+    map->entry = path_res->target_entry;
+    map->refs = 1;
+    pthread_rwlock_init(&map->lock, NULL);
+
+    /* a chain leaving the data area, or longer than it, is corrupt */
+    pthread_rwlock_rdlock(&echfs.fat_lock);
+    uint64_t left = echfs.blocks - echfs.data_start;
+    for (uint64_t block = path_entry(path_res)->payload; block != END_OF_CHAIN;
+            block = echfs.fat[block]) {
+        if (block < echfs.data_start || block >= echfs.blocks || !left--
+                || extent_append(map, block, 1)) {
+            pthread_rwlock_unlock(&echfs.fat_lock);
+            pthread_rwlock_destroy(&map->lock);
+            free(map->extents);
+            free(map);
+            return NULL;
+        }
+    }
+    pthread_rwlock_unlock(&echfs.fat_lock);
+
+    map->next = open_files;
+    open_files = map;
+    return map;
+}
+
+/* must be called with handles_lock held for writing. The blocks of a file
+ * unlinked while open are freed along with its last handle. */
+static void put_extents(struct extent_map *map) {
+    if (--map->refs)
+        return;
+    if (map->entry == SEARCH_FAILURE && map->count) {
+        pthread_rwlock_wrlock(&echfs.fat_lock);
+        release_chain(map->extents[0].start);
+        pthread_rwlock_unlock(&echfs.fat_lock);
+    }
+    for (struct extent_map **p = &open_files; *p; p = &(*p)->next) {
+        if (*p == map) {
+            *p = map->next;
+            break;
+        }
+    }
+    pthread_rwlock_destroy(&map->lock);
+    free(map->extents);
+    free(map);
+}
+
+/* must be called with handles_lock held for writing, returns whether the
+ * file was open */
+static int detach_extents(uint64_t entry) {
+    int detached = 0;
+    for (struct extent_map *map = open_files; map; map = map->next) {
+        if (map->entry == entry) {
+            map->entry = SEARCH_FAILURE;
+            detached = 1;
+        }
+    }
+    return detached;
+}
+
+/* with dir_lock held */
+static void remember_cached(struct path_result_t *path_res) {
+    path_res->cached_mtime = path_entry(path_res)->mtime;
+    path_res->cached_size = path_entry(path_res)->size;
+    path_res->cache_valid = 1;
+}
+
+/* gives a new handle on the file path_res refers to, with handles_lock held
+ * for writing and dir_lock held. On success the handle takes over the
+ * caller's reference. */
+static int open_file(struct path_result_t *path_res,
+        struct fuse_file_info *file_info) {
+    if (path_entry(path_res)->type == DIRECTORY_TYPE)
+        return -EISDIR;
 
     int handle_num = get_handle();
-    if (handle_num < 0) return -ENOMEM;
+    if (handle_num < 0)
+        return -ENOMEM;
+
+    struct extent_map *extents = get_extents(path_res);
+    if (!extents)
+        return -ENOMEM;
     file_info->fh = handle_num;
 
     struct echfs_handle_t *handle = &handles[file_info->fh];
-    handle->path_res = path_result;
+    handle->path_res = path_res;
+    handle->extents = extents;
+    handle->next_read = 0;
+    handle->readahead_end = 0;
+    handle->closed = 0;
+    handle->refs = 1;
     handle->occupied = 1;
 
-    handle->alloc_map = malloc(sizeof(uint64_t));
-    handle->alloc_map[0] = path_result->target.payload;
-    uint64_t i = 1;
-    for (i = 1; handle->alloc_map[i - 1] != END_OF_CHAIN; i++) {
-        handle->alloc_map = realloc(handle->alloc_map,
-                sizeof(uint64_t) * (i + 1));
-        handle->alloc_map[i] = echfs.fat[handle->alloc_map[i - 1]];
-    }
-
-    handle->total_blocks = i - 1;
-
+    /* every write goes through the kernel, so its pages are only stale if
+     * the file changed behind them */
+    struct entry_t *entry = path_entry(path_res);
+    file_info->keep_cache = path_res->cache_valid &&
+        path_res->cached_mtime == entry->mtime &&
+        path_res->cached_size == entry->size;
+    remember_cached(path_res);
     return 0;
 }
 
-static int echfs_opendir(const char *dir_path,
+/* the same for a directory */
+static int open_dir(struct path_result_t *path_res,
         struct fuse_file_info *file_info) {
-    echfs_debug("opening dir %s\n", dir_path);
-    struct path_result_t *path_result = resolve_path(dir_path);
-    if (path_result->failure) {
-        return -ENOENT;
-    }
-
-    if (path_result->target.type == FILE_TYPE) {
+    if (path_entry(path_res)->type == FILE_TYPE)
         return -ENOTDIR;
-    }
 
     int handle = get_handle();
-    if (handle < 0) return -ENOMEM;
+    if (handle < 0)
+        return -ENOMEM;
     file_info->fh = handle;
 
-    handles[handle].path_res = path_result;
+    handles[handle].path_res = path_res;
     handles[handle].occupied = 1;
     return 0;
 }
 
-static int echfs_fgetattr(const char *path, struct stat *stat,
+static int echfs_open(const char *file_path, struct fuse_file_info *file_info) {
+    echfs_debug("opening file %s\n", file_path);
+    pthread_rwlock_wrlock(&handles_lock);
+    pthread_rwlock_rdlock(&echfs.dir_lock);
+    struct path_result_t *path_result = resolve_path(file_path);
+    int ret = path_result->failure ? -ENOENT :
+        open_file(path_result, file_info);
+    /* on success the handle keeps the reference */
+    if (ret)
+        put_path(path_result);
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    pthread_rwlock_unlock(&handles_lock);
+    return ret;
+}
+
+static int echfs_opendir(const char *dir_path,
         struct fuse_file_info *file_info) {
-    echfs_debug("fgetattr() on %s\n", path);
-    if (file_info->fh >= MAX_HANDLES) return -EBADF;
-    if (!handles[file_info->fh].occupied) return -EBADF;
-    struct echfs_handle_t *handle = &handles[file_info->fh];
-    struct path_result_t *path_result = handle->path_res;
+    echfs_debug("opening dir %s\n", dir_path);
+    pthread_rwlock_wrlock(&handles_lock);
+    pthread_rwlock_rdlock(&echfs.dir_lock);
+    struct path_result_t *path_result = resolve_path(dir_path);
+    int ret = path_result->failure ? -ENOENT :
+        open_dir(path_result, file_info);
+    if (ret)
+        put_path(path_result);
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    pthread_rwlock_unlock(&handles_lock);
+    return ret;
+}
 
-    stat->st_ino = path_result->target_entry + 1;
+static void fill_stat(struct stat *stat, const struct entry_t *entry,
+        uint64_t slot) {
+    memset(stat, 0, sizeof(struct stat));
+    stat->st_ino = slot_ino(slot);
     stat->st_nlink = 1;
-    stat->st_uid = path_result->target.owner;
-    stat->st_gid = path_result->target.group;
-    stat->st_rdev = 0;
-    stat->st_size = path_result->target.size;
+    stat->st_uid = entry->owner;
+    stat->st_gid = entry->group;
+    stat->st_size = entry->size;
     stat->st_blksize = 512;
     stat->st_blocks = (stat->st_size + 512 - 1) / 512;
-    stat->st_atim.tv_sec = path_result->target.atime;
-    stat->st_atim.tv_nsec = 0;
-    stat->st_mtim.tv_sec = path_result->target.mtime;
-    stat->st_mtim.tv_nsec = 0;
-    stat->st_ctim.tv_sec = path_result->target.ctime;
-    stat->st_ctim.tv_nsec = 0;
-
-    stat->st_mode = 0;
-    switch (path_result->target.type) {
+    stat->st_atim.tv_sec = entry->atime;
+    stat->st_mtim.tv_sec = entry->mtime;
+    stat->st_ctim.tv_sec = entry->ctime;
+
+    switch (entry->type) {
         case DIRECTORY_TYPE:
             stat->st_mode |= S_IFDIR;
             break;
@@ -632,420 +2267,1750 @@ static int echfs_fgetattr(const char *path, struct stat *stat,
             stat->st_mode |= S_IFREG;
             break;
     }
-    stat->st_mode |= S_IRWXU;
-    stat->st_mode |= S_IRWXO;
+    stat->st_mode |= entry->perms;
+}
+
+static int echfs_fgetattr(const char *path, struct stat *stat,
+        struct fuse_file_info *file_info) {
+    (void) path;
+    echfs_debug("fgetattr() on handle %lu\n", file_info->fh);
+    if (file_info->fh >= MAX_HANDLES) return -EBADF;
+    pthread_rwlock_rdlock(&handles_lock);
+    if (!handles[file_info->fh].occupied || handles[file_info->fh].closed) {
+        pthread_rwlock_unlock(&handles_lock);
+        return -EBADF;
+    }
+    struct echfs_handle_t *handle = &handles[file_info->fh];
+    struct path_result_t *path_result = handle->path_res;
+
+    pthread_rwlock_rdlock(&echfs.dir_lock);
+    fill_stat(stat, path_entry(path_result), path_result->target_entry);
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    pthread_rwlock_unlock(&handles_lock);
+    return 0;
+}
+
+static int echfs_getattr(const char *path, struct stat *stat) {
+    echfs_debug("getattr() on %s\n", path);
+
+    pthread_rwlock_rdlock(&echfs.dir_lock);
+    struct path_result_t *path_result = resolve_path(path);
+    if (path_result->failure) {
+        put_path(path_result);
+        pthread_rwlock_unlock(&echfs.dir_lock);
+        return -ENOENT;
+    }
+
+    fill_stat(stat, path_entry(path_result), path_result->target_entry);
+    put_path(path_result);
+    pthread_rwlock_unlock(&echfs.dir_lock);
     return 0;
 }
 
-static int echfs_getattr(const char *path, struct stat *stat) {
-    echfs_debug("getattr() on %s\n", path);
+static int echfs_readdir(const char *path, void *buf, fuse_fill_dir_t fill,
+        off_t offset, struct fuse_file_info *file_info) {
+    (void) path;
+    echfs_debug("readdir() on handle %lu and offset %lu\n", file_info->fh,
+            offset);
+
+    if (file_info->fh >= MAX_HANDLES) return -EBADF;
+    pthread_rwlock_rdlock(&handles_lock);
+    struct echfs_handle_t *handle = &handles[file_info->fh];
+    if (!handle->occupied) {
+        pthread_rwlock_unlock(&handles_lock);
+        return -EBADF;
+    }
+
+    pthread_rwlock_rdlock(&echfs.dir_lock);
+    int ret = 0;
+    if (path_entry(handle->path_res)->type != DIRECTORY_TYPE) {
+        ret = -ENOTDIR;
+        goto out;
+    }
+
+    /*
+     * cookies 1 and 2 are . and .., a child's cookie is its slot plus 3.
+     * Children come with their attributes so that listings with stat
+     * don't need a getattr per entry.
+     */
+    struct stat stat;
+    fill_stat(&stat, path_entry(handle->path_res),
+            handle->path_res->target_entry);
+    if (offset < 1 && fill(buf, ".", &stat, 1)) goto out;
+    if (offset < 2 && fill(buf, "..", NULL, 2)) goto out;
+
+    struct dir_children *dir =
+        find_children(path_entry(handle->path_res)->payload);
+    if (!dir) goto out;
+    uint64_t i = offset < 3 ? 0 : children_lower_bound(dir, offset - 2);
+    for (; i < dir->count; i++) {
+        uint64_t slot = dir->slots[i];
+        fill_stat(&stat, &echfs.dir_table[slot], slot);
+        if (fill(buf, echfs.dir_table[slot].name, &stat, slot + 3)) goto out;
+    }
+
+out:
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    pthread_rwlock_unlock(&handles_lock);
+    return ret;
+}
+
+/* frees the slot of a closed file handle, with handles_lock held for
+ * writing */
+static void free_handle(struct echfs_handle_t *handle) {
+    handle->occupied = 0;
+    put_extents(handle->extents);
+    put_path(handle->path_res);
+}
+
+/*
+ * takes a reference on the open file handle fh, with handles_lock held, so
+ * that a read or write can go on using it once handles_lock is dropped.
+ */
+static int get_file_handle(uint64_t fh, struct echfs_handle_t **handle_out) {
+    struct echfs_handle_t *handle = &handles[fh];
+    if (!handle->occupied || handle->closed)
+        return -EBADF;
+    if (path_entry(handle->path_res)->type != FILE_TYPE)
+        return -EISDIR;
+    __atomic_add_fetch(&handle->refs, 1, __ATOMIC_RELAXED);
+    *handle_out = handle;
+    return 0;
+}
+
+/* drops a reference taken by get_file_handle(). Once the handle is closed
+ * no new ones are taken, so only one caller sees the count reach zero. */
+static void put_file_handle(struct echfs_handle_t *handle) {
+    if (__atomic_sub_fetch(&handle->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+    pthread_rwlock_wrlock(&handles_lock);
+    free_handle(handle);
+    pthread_rwlock_unlock(&handles_lock);
+}
+
+static int echfs_release(const char *path,
+        struct fuse_file_info *file_info) {
+    (void) path;
+    if (file_info->fh >= MAX_HANDLES) return -EBADF;
+    pthread_rwlock_wrlock(&handles_lock);
+    struct echfs_handle_t *handle = &handles[file_info->fh];
+    int ret = 0;
+    if (!handle->occupied || handle->closed) {
+        ret = -EBADF;
+    } else if (path_entry(handle->path_res)->type != FILE_TYPE) {
+        ret = -EISDIR;
+    } else {
+        echfs_debug("released handle %lu\n", file_info->fh);
+        pthread_rwlock_rdlock(&echfs.dir_lock);
+        remember_cached(handle->path_res);
+        pthread_rwlock_unlock(&echfs.dir_lock);
+        /* reads and writes still in flight free the slot after them */
+        handle->closed = 1;
+        if (!__atomic_sub_fetch(&handle->refs, 1, __ATOMIC_ACQ_REL))
+            free_handle(handle);
+    }
+    pthread_rwlock_unlock(&handles_lock);
+    return ret;
+}
+
+static int echfs_releasedir(const char *path,
+        struct fuse_file_info *file_info) {
+    (void) path;
+    if (file_info->fh >= MAX_HANDLES) return -EBADF;
+    pthread_rwlock_wrlock(&handles_lock);
+    int ret = 0;
+    if (!handles[file_info->fh].occupied)
+        ret = -EBADF;
+    else if (path_entry(handles[file_info->fh].path_res)->type != DIRECTORY_TYPE)
+        ret = -EISDIR;
+    else {
+        handles[file_info->fh].occupied = 0;
+        put_path(handles[file_info->fh].path_res);
+    }
+    pthread_rwlock_unlock(&handles_lock);
+    return ret;
+}
+
+/* asks the kernel to start reading [loc, loc + count) of the image */
+static void advise_willneed(uint64_t loc, uint64_t count) {
+    if (echfs.map) {
+        /* madvise() wants a page aligned address, the map base is one */
+        uint64_t page_offset = (echfs.map_delta + loc) %
+            sysconf(_SC_PAGESIZE);
+        madvise(echfs.map + loc - page_offset, count + page_offset,
+                MADV_WILLNEED);
+        return;
+    }
+    posix_fadvise(echfs.fd, echfs.part_offset + loc, count,
+            POSIX_FADV_WILLNEED);
+}
+
+/*
+ * keeps the next echfs.readahead bytes of a file that is being read
+ * sequentially on their way into the page cache. The extents say where
+ * they are, so a fragmented file is prefetched run by run instead of
+ * relying on the kernel's readahead, which only sees the image as one
+ * file. Must be called from begin_read().
+ */
+static void readahead_file(struct echfs_handle_t *handle, uint64_t offset,
+        uint64_t count, uint64_t size) {
+    uint64_t end = offset + count;
+    uint64_t expected = __atomic_exchange_n(&handle->next_read, end,
+            __ATOMIC_RELAXED);
+    if (!echfs.readahead)
+        return;
+    if (offset != expected) {
+        /* a seek starts the window over at the next sequential read */
+        __atomic_store_n(&handle->readahead_end, 0, __ATOMIC_RELAXED);
+        return;
+    }
+
+    /* the window is topped up once half of it has been consumed */
+    uint64_t start = __atomic_load_n(&handle->readahead_end,
+            __ATOMIC_RELAXED);
+    if (start < end)
+        start = end;
+    if (start - end >= echfs.readahead / 2)
+        return;
+    uint64_t limit = end + echfs.readahead;
+    if (limit > size)
+        limit = size;
+    if (limit <= start)
+        return;
+    __atomic_store_n(&handle->readahead_end, limit, __ATOMIC_RELAXED);
+
+    while (start < limit) {
+        uint64_t block = start / echfs.bytes_per_block;
+        uint64_t loc, run;
+        if (extent_lookup(handle->extents, block, &loc, &run))
+            break;
+        loc *= echfs.bytes_per_block;
+
+        uint64_t chunk = limit - start;
+        uint64_t disk_offset = start % echfs.bytes_per_block;
+        if (chunk > run * echfs.bytes_per_block - disk_offset)
+            chunk = run * echfs.bytes_per_block - disk_offset;
+
+        advise_willneed(loc + disk_offset, chunk);
+        start += chunk;
+    }
+}
+
+/*
+ * describes the bytes [offset, offset + count) of an open file as ranges of
+ * the image, one per physically contiguous run, so that libfuse can splice
+ * them. Must be called with the extent list held, as begin_read() and
+ * begin_write() leave it; the caller frees *bufv_out.
+ */
+static int file_runs(struct extent_map *map, uint64_t offset,
+        uint64_t count, struct fuse_bufvec **bufv_out) {
+    uint64_t runs = 0;
+    for (uint64_t progress = 0; progress < count; runs++) {
+        uint64_t block = (offset + progress) / echfs.bytes_per_block;
+        uint64_t start, run;
+        if (extent_lookup(map, block, &start, &run))
+            return -EIO;
+        progress += run * echfs.bytes_per_block -
+            (offset + progress) % echfs.bytes_per_block;
+    }
+
+    struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) +
+            (runs ? runs - 1 : 0) * sizeof(struct fuse_buf));
+    if (!bufv)
+        return -ENOMEM;
+    bufv->count = runs;
+    bufv->idx = 0;
+    bufv->off = 0;
+
+    uint64_t progress = 0;
+    for (uint64_t i = 0; i < runs; i++) {
+        uint64_t block = (offset + progress) / echfs.bytes_per_block;
+        uint64_t loc, run;
+        if (extent_lookup(map, block, &loc, &run)) {
+            free(bufv);
+            return -EIO;
+        }
+        loc *= echfs.bytes_per_block;
+
+        uint64_t chunk = count - progress;
+        uint64_t disk_offset = (offset + progress) % echfs.bytes_per_block;
+        if (chunk > run * echfs.bytes_per_block - disk_offset)
+            chunk = run * echfs.bytes_per_block - disk_offset;
+
+        bufv->buf[i].size = chunk;
+        bufv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bufv->buf[i].mem = NULL;
+        bufv->buf[i].fd = echfs.fd;
+        bufv->buf[i].pos = echfs.part_offset + loc + disk_offset;
+        progress += chunk;
+    }
+    *bufv_out = bufv;
+    return 0;
+}
+
+/*
+ * clamps a read of an open handle to the file size. On success it returns
+ * with a reference on the handle and the file's extent list held for
+ * reading, for the caller to copy the data and then call end_read().
+ */
+static int begin_read(struct fuse_file_info *file_info, uint64_t offset,
+        size_t *count, struct echfs_handle_t **handle_out) {
+    if (file_info->fh >= MAX_HANDLES) return -EBADF;
+
+    /* the data itself is read with neither handles_lock nor dir_lock
+     * held, so that reads never hold up opens, closes or reads of other
+     * files */
+    struct echfs_handle_t *handle;
+    pthread_rwlock_rdlock(&handles_lock);
+    int ret = get_file_handle(file_info->fh, &handle);
+    pthread_rwlock_unlock(&handles_lock);
+    if (ret)
+        return ret;
+
+    /* a write growing the file holds this until its data is in place,
+     * and truncation until the chain matches the new size */
+    pthread_rwlock_rdlock(&handle->extents->lock);
+    pthread_rwlock_rdlock(&echfs.dir_lock);
+    uint64_t size = path_entry(handle->path_res)->size;
+    pthread_rwlock_unlock(&echfs.dir_lock);
+
+    if (offset >= size)
+        *count = 0;
+    else if ((offset + *count) >= size)
+        *count = size - offset;
+
+    /* the entry may claim more than its chain holds */
+    if (*count && (offset + *count + echfs.bytes_per_block - 1) /
+            echfs.bytes_per_block > handle->extents->total_blocks) {
+        pthread_rwlock_unlock(&handle->extents->lock);
+        put_file_handle(handle);
+        return -EIO;
+    }
+
+    if (*count)
+        readahead_file(handle, offset, *count, size);
+
+    *handle_out = handle;
+    return 0;
+}
+
+static void end_read(struct echfs_handle_t *handle) {
+    pthread_rwlock_unlock(&handle->extents->lock);
+    put_file_handle(handle);
+}
+
+static int echfs_read(const char *path, char *buf, size_t to_read,
+        off_t offset, struct fuse_file_info *file_info) {
+    (void) path;
+    echfs_debug("echfs_read() on handle %lu, %lu\n", file_info->fh, to_read);
+    struct echfs_handle_t *handle;
+    int ret = begin_read(file_info, offset, &to_read, &handle);
+    if (ret)
+        return ret;
+
+    uint64_t progress = 0;
+    while (progress < to_read) {
+        uint64_t block = (offset + progress) / echfs.bytes_per_block;
+        uint64_t loc, run;
+        if (extent_lookup(handle->extents, block, &loc, &run)) {
+            end_read(handle);
+            return -EIO;
+        }
+        loc *= echfs.bytes_per_block;
+
+        uint64_t chunk = to_read - progress;
+        uint64_t disk_offset = (offset + progress) % echfs.bytes_per_block;
+        if (chunk > run * echfs.bytes_per_block - disk_offset)
+            chunk = run * echfs.bytes_per_block - disk_offset;
+
+        if (data_pread(buf + progress, chunk, loc + disk_offset)) {
+            end_read(handle);
+            return -EIO;
+        }
+        progress += chunk;
+    }
+
+    end_read(handle);
+    return to_read;
+}
+
+/* finds a free run of count blocks anywhere, searching from the cursor;
+ * returns SEARCH_FAILURE if the free space is too fragmented for one */
+static uint64_t find_whole_run(uint64_t count) {
+    uint64_t pos = echfs.alloc_cursor;
+    uint64_t scanned = 0;
+    while (scanned < echfs.blocks) {
+        uint64_t len;
+        uint64_t start = find_free_run(pos, count, &len);
+        if (len == count)
+            return start;
+        /* stop once the search has wrapped around to where it began */
+        uint64_t next = start + len;
+        scanned += (next > pos) ? next - pos : echfs.blocks - pos + next;
+        pos = next;
+    }
+    return SEARCH_FAILURE;
+}
+
+/*
+ * allocates count blocks, chaining them after prev_block (0 for a new
+ * chain) and appending them to the extent list run by run. A single
+ * contiguous run is preferred; if the free space is too fragmented the
+ * first free runs after the cursor are used instead. Must be called with
+ * fat_lock held for writing.
+ */
+static int allocate_blocks(uint64_t prev_block, uint64_t count,
+        struct extent_map *map) {
+    if (!count)
+        return 0;
+    if (count > echfs.free_blocks)
+        return -ENOSPC;
+
+    uint64_t whole = find_whole_run(count);
+
+    /*
+     * the runs are counted first so that the extent list can be grown
+     * before anything is allocated, which leaves extent_append() below
+     * nothing to fail on. Nothing is marked while counting, so once the
+     * search wraps around a run is cut at the cursor: the blocks from
+     * there on were counted already, and the second pass, which marks
+     * them, finds them taken.
+     */
+    uint64_t runs = 1;
+    if (whole == SEARCH_FAILURE) {
+        runs = 0;
+        uint64_t cursor = echfs.alloc_cursor;
+        int wrapped = 0;
+        for (uint64_t pos = cursor, got = 0; got < count; runs++) {
+            uint64_t len;
+            uint64_t start = find_free_run(pos, count - got, &len);
+            if (start == SEARCH_FAILURE)
+                return -ENOSPC;
+            if (start < pos)
+                wrapped = 1;
+            if (wrapped && start >= cursor)
+                return -ENOSPC;
+            if (wrapped && start + len > cursor)
+                len = cursor - start;
+            got += len;
+            pos = start + len;
+        }
+    }
+    if (extent_reserve(map, runs))
+        return -ENOMEM;
+
+    for (uint64_t pos = echfs.alloc_cursor, got = 0; got < count; ) {
+        uint64_t len = count;
+        uint64_t start = whole;
+        if (whole == SEARCH_FAILURE)
+            start = find_free_run(pos, count - got, &len);
+        for (uint64_t i = 0; i < len; i++) {
+            mark_block(start + i, 1);
+            wr_fat(start + i, (i + 1 < len) ? start + i + 1 : END_OF_CHAIN);
+        }
+        if (prev_block)
+            wr_fat(prev_block, start);
+        extent_append(map, start, len);
+        prev_block = start + len - 1;
+        got += len;
+        pos = start + len;
+    }
+
+    echfs.free_blocks -= count;
+    echfs.alloc_cursor = prev_block + 1;
+    if (echfs.alloc_cursor >= echfs.blocks)
+        echfs.alloc_cursor = echfs.data_start;
+    return 0;
+}
+
+/*
+ * grows the chain to at least `blocks` blocks, in a single allocation so
+ * that the new blocks are contiguous where free space allows. Must be
+ * called with the file's extent list and dir_lock held for writing.
+ */
+static int extend_chain(struct path_result_t *path_res,
+        struct extent_map *map, uint64_t blocks) {
+    if (blocks <= map->total_blocks)
+        return 0;
+
+    uint64_t old_blocks = map->total_blocks;
+    uint64_t prev_block = 0;
+    if (map->count) {
+        struct extent_t *last = &map->extents[map->count - 1];
+        prev_block = last->start + last->length - 1;
+    }
+    pthread_rwlock_wrlock(&echfs.fat_lock);
+    int ret = allocate_blocks(prev_block, blocks - old_blocks, map);
+    pthread_rwlock_unlock(&echfs.fat_lock);
+    if (ret)
+        return ret;
+
+    if (!old_blocks)
+        path_entry(path_res)->payload = map->extents[0].start;
+    sync_entry(path_res);
+    return 0;
+}
+
+/* frees the blocks of the chain from `blocks` on, with the file's extent
+ * list and dir_lock held for writing */
+static void shrink_chain(struct path_result_t *path_res,
+        struct extent_map *map, uint64_t blocks) {
+    if (blocks >= map->total_blocks)
+        return;
+
+    pthread_rwlock_wrlock(&echfs.fat_lock);
+    if (blocks) {
+        uint64_t last, run;
+        if (!extent_lookup(map, blocks - 1, &last, &run)) {
+            release_chain(echfs.fat[last]);
+            wr_fat(last, END_OF_CHAIN);
+        }
+    } else {
+        release_chain(path_entry(path_res)->payload);
+        path_entry(path_res)->payload = END_OF_CHAIN;
+    }
+    pthread_rwlock_unlock(&echfs.fat_lock);
+    extent_trim(map, blocks);
+}
+
+/* zeroes the bytes [from, to) of the file, which must be allocated */
+static int zero_range(struct extent_map *map, uint64_t from, uint64_t to) {
+    static const char zeroes[65536];
+    while (from < to) {
+        uint64_t block = from / echfs.bytes_per_block;
+        uint64_t loc, run;
+        if (extent_lookup(map, block, &loc, &run))
+            return -EIO;
+        loc *= echfs.bytes_per_block;
+
+        uint64_t chunk = to - from;
+        uint64_t block_offset = from % echfs.bytes_per_block;
+        if (chunk > run * echfs.bytes_per_block - block_offset)
+            chunk = run * echfs.bytes_per_block - block_offset;
+        if (chunk > sizeof(zeroes))
+            chunk = sizeof(zeroes);
+
+        if (data_pwrite(zeroes, chunk, loc + block_offset))
+            return -EIO;
+        from += chunk;
+    }
+    return 0;
+}
+
+/*
+ * sets the size of a file and makes its chain cover exactly that much,
+ * dropping any blocks preallocated past the end. Bytes the file gains
+ * read as zeroes. Must be called with the file's extent list and dir_lock
+ * held for writing.
+ */
+static int resize_file(struct path_result_t *path_res,
+        struct extent_map *map, uint64_t size) {
+    struct entry_t *entry = path_entry(path_res);
+    uint64_t blocks = (size + echfs.bytes_per_block - 1) / echfs.bytes_per_block;
+    if (size > entry->size) {
+        int ret = extend_chain(path_res, map, blocks);
+        if (!ret)
+            ret = zero_range(map, entry->size, size);
+        if (ret)
+            return ret;
+    }
+    shrink_chain(path_res, map, blocks);
+
+    entry->size = size;
+    entry->ctime = entry->mtime = get_time();
+    sync_entry(path_res);
+    return 0;
+}
+
+/*
+ * prepares a write of `count` bytes at `offset` to an open handle. Writes
+ * hold a reference on the handle and the extent list for reading, so
+ * writes to different files, and writes within the same file, run side by
+ * side. A write that grows the file holds its extent list for writing
+ * until end_write(), which sets the new size: nothing reads the new
+ * blocks, and no other write of the file changes the chain, before the
+ * data is in.
+ */
+static int begin_write(struct fuse_file_info *file_info, uint64_t offset,
+        uint64_t count, struct echfs_handle_t **handle_out, int *grows) {
+    if (file_info->fh >= MAX_HANDLES) return -EBADF;
+
+    struct echfs_handle_t *handle;
+    pthread_rwlock_rdlock(&handles_lock);
+    int ret = get_file_handle(file_info->fh, &handle);
+    pthread_rwlock_unlock(&handles_lock);
+    if (ret)
+        return ret;
+
+    struct extent_map *map = handle->extents;
+    pthread_rwlock_rdlock(&map->lock);
+    pthread_rwlock_wrlock(&echfs.dir_lock);
+    uint64_t old_size = path_entry(handle->path_res)->size;
+    if (offset + count > old_size) {
+        /* the size can only change under the exclusive lock, read it
+         * again once that is held */
+        pthread_rwlock_unlock(&echfs.dir_lock);
+        pthread_rwlock_unlock(&map->lock);
+        pthread_rwlock_wrlock(&map->lock);
+        pthread_rwlock_wrlock(&echfs.dir_lock);
+        old_size = path_entry(handle->path_res)->size;
+    }
+    *grows = offset + count > old_size;
+
+    ret = update_mtime(handle->path_res);
+    /* grow the chain up front so the copy needs no metadata locks */
+    if (!ret && *grows)
+        ret = extend_chain(handle->path_res, map,
+                (offset + count + echfs.bytes_per_block - 1) /
+                echfs.bytes_per_block);
+    pthread_rwlock_unlock(&echfs.dir_lock);
+
+    /* a write past the end must not expose what the gap held before */
+    if (!ret && offset > old_size && zero_range(map, old_size, offset))
+        ret = -EIO;
+    if (ret) {
+        pthread_rwlock_unlock(&map->lock);
+        put_file_handle(handle);
+        return ret;
+    }
+
+    *handle_out = handle;
+    return 0;
+}
+
+/* drops the locks taken by begin_write(), first setting the new size of a
+ * file that a successful write grew */
+static void end_write(struct echfs_handle_t *handle, int grows,
+        uint64_t end, int ret) {
+    if (grows && ret >= 0) {
+        pthread_rwlock_wrlock(&echfs.dir_lock);
+        if (end > path_entry(handle->path_res)->size) {
+            path_entry(handle->path_res)->size = end;
+            sync_entry(handle->path_res);
+        }
+        pthread_rwlock_unlock(&echfs.dir_lock);
+    }
+    pthread_rwlock_unlock(&handle->extents->lock);
+    put_file_handle(handle);
+}
+
+static int echfs_write(const char *path, const char *buf, size_t to_write,
+        off_t offset, struct fuse_file_info *file_info) {
+    (void) path;
+    echfs_debug("echfs_write() on handle %lu\n", file_info->fh);
+    struct echfs_handle_t *handle;
+    int grows;
+    int ret = begin_write(file_info, offset, to_write, &handle, &grows);
+    if (ret)
+        return ret;
+
+    ret = to_write;
+    uint64_t progress = 0;
+    while (progress < to_write) {
+        uint64_t block = (offset + progress) / echfs.bytes_per_block;
+        uint64_t loc, run;
+        if (extent_lookup(handle->extents, block, &loc, &run)) {
+            ret = -EIO;
+            break;
+        }
+        loc *= echfs.bytes_per_block;
+
+        uint64_t chunk = to_write - progress;
+        uint64_t buf_offset = (offset + progress) % echfs.bytes_per_block;
+        if (chunk > run * echfs.bytes_per_block - buf_offset)
+            chunk = run * echfs.bytes_per_block - buf_offset;
+
+        if (data_pwrite(buf + progress, chunk, loc + buf_offset)) {
+            ret = -EIO;
+            break;
+        }
+        progress += chunk;
+    }
+
+    end_write(handle, grows, offset + to_write, ret);
+    return ret;
+}
+
+/*
+ * data that arrives in a pipe is spliced straight into the image, one
+ * physically contiguous run at a time. Data in memory takes the usual
+ * path.
+ */
+static int echfs_write_buf(const char *path, struct fuse_bufvec *buf,
+        off_t offset, struct fuse_file_info *file_info) {
+    if (buf->count - buf->idx == 1 &&
+            !(buf->buf[buf->idx].flags & FUSE_BUF_IS_FD))
+        return echfs_write(path, (char *)buf->buf[buf->idx].mem + buf->off,
+                fuse_buf_size(buf), offset, file_info);
+
+    echfs_debug("echfs_write_buf() on handle %lu\n", file_info->fh);
+    size_t to_write = fuse_buf_size(buf);
+
+    /* splicing would go around the block cache, gather the data instead */
+    if (echfs.cache_size) {
+        struct fuse_bufvec mem = FUSE_BUFVEC_INIT(to_write);
+        mem.buf[0].mem = malloc(to_write);
+        if (!mem.buf[0].mem)
+            return -ENOMEM;
+        ssize_t copied = fuse_buf_copy(&mem, buf, 0);
+        int ret = copied < 0 ? (int)copied :
+            echfs_write(path, mem.buf[0].mem, copied, offset, file_info);
+        free(mem.buf[0].mem);
+        return ret;
+    }
+
+    struct echfs_handle_t *handle;
+    int grows;
+    int ret = begin_write(file_info, offset, to_write, &handle, &grows);
+    if (ret)
+        return ret;
+
+    struct fuse_bufvec *runs = NULL;
+    ssize_t copied = file_runs(handle->extents, offset, to_write, &runs);
+    if (!copied)
+        copied = fuse_buf_copy(runs, buf, 0);
+    free(runs);
+    if (copied < 0)
+        ret = copied;
+    else
+        ret = copied == (ssize_t)to_write ? (int)to_write : -EIO;
+    end_write(handle, grows, offset + to_write, ret);
+    return ret;
+}
+
+/* returns the lowest deleted slot, or the end marker's slot if there is
+ * none. Must be called with dir_lock held for writing. */
+static uint64_t find_free_entry() {
+    uint64_t words = (echfs.dir_index.end + 63) / 64;
+    uint64_t *map = echfs.dir_index.deleted_map;
+    for (; echfs.dir_index.deleted_hint < words; echfs.dir_index.deleted_hint++) {
+        uint64_t word = map[echfs.dir_index.deleted_hint];
+        if (word)
+            return echfs.dir_index.deleted_hint * 64 + __builtin_ctzll(word);
+    }
+
+    if (echfs.dir_index.end >= echfs.dir_size * echfs.entries_per_block)
+        return SEARCH_FAILURE;
+    return echfs.dir_index.end;
+}
+
+/*
+ * removes the entry in a slot. The last entry becomes the end marker
+ * instead, along with any deleted entries right before it, so that
+ * scans of the directory stop as early as possible.
+ */
+static void delete_entry(uint64_t pos) {
+    struct entry_t entry = {0};
+    if (pos + 1 != echfs.dir_index.end) {
+        entry.parent_id = DELETED_ENTRY;
+        wr_entry(&entry, pos);
+        return;
+    }
+
+    wr_entry(&entry, pos);
+    while (echfs.dir_index.end &&
+            echfs.dir_table[echfs.dir_index.end - 1].parent_id == DELETED_ENTRY)
+        wr_entry(&entry, echfs.dir_index.end - 1);
+}
+
+/* the directory ID functions must be called with dir_lock held for writing */
+static uint64_t alloc_dir_id() {
+    if (echfs.dir_index.free_dir_count)
+        return echfs.dir_index.free_dir_ids[--echfs.dir_index.free_dir_count];
+    if (echfs.dir_index.next_dir_id >= RESERVED_BLOCK)
+        return SEARCH_FAILURE;
+    return echfs.dir_index.next_dir_id++;
+}
+
+/* an ID that can't be remembered is simply never reused */
+static void free_dir_id(uint64_t id) {
+    if (echfs.dir_index.free_dir_count == echfs.dir_index.free_dir_capacity) {
+        uint64_t capacity = echfs.dir_index.free_dir_capacity ?
+            echfs.dir_index.free_dir_capacity * 2 : 16;
+        uint64_t *ids = realloc(echfs.dir_index.free_dir_ids,
+                capacity * sizeof(uint64_t));
+        if (!ids)
+            return;
+        echfs.dir_index.free_dir_ids = ids;
+        echfs.dir_index.free_dir_capacity = capacity;
+    }
+    echfs.dir_index.free_dir_ids[echfs.dir_index.free_dir_count++] = id;
+}
+
+/*
+ * writes a new entry for a file or directory named `name` into the
+ * directory `parent_id` and returns its slot in *slot. Must be called with
+ * dir_lock held for writing.
+ */
+static int make_entry(uint64_t parent_id, const char *name, int type,
+        mode_t mode, uint64_t *slot) {
+    if (strlen(name) >= FILENAME_LEN)
+        return -ENAMETOOLONG;
+
+    uint64_t new_entry = find_free_entry();
+    if (new_entry == SEARCH_FAILURE)
+        return -EIO;
+
+    struct entry_t entry = {0};
+    entry.parent_id = parent_id;
+    entry.type = type;
+    strcpy(entry.name, name);
+    entry.perms = mode;
+    entry.payload = END_OF_CHAIN;
+    if (type == DIRECTORY_TYPE) {
+        entry.payload = alloc_dir_id();
+        if (entry.payload == SEARCH_FAILURE)
+            return -ENOSPC;
+    }
+    entry.atime = entry.mtime = entry.ctime = get_time();
+
+    wr_entry(&entry, new_entry);
+    *slot = new_entry;
+    return 0;
+}
+
+static int echfs_create(const char *path, mode_t mode,
+        struct fuse_file_info *file_info) {
+    echfs_debug("echfs_create() on %s\n", path);
+    pthread_rwlock_wrlock(&handles_lock);
+    pthread_rwlock_wrlock(&echfs.dir_lock);
+    struct path_result_t *path_res = resolve_path(path);
+    int ret = 0;
+    if (!path_res->failure) {
+        ret = -EEXIST;
+        goto out;
+    }
+
+    uint64_t new_entry;
+    ret = make_entry(path_res->parent_id, path_name(path_res->path),
+            FILE_TYPE, mode, &new_entry);
+    if (ret)
+        goto out;
+
+    path_res->target_entry = new_entry;
+    path_res->failure = 0;
+    path_res = cache_path(path_res);
+    ret = open_file(path_res, file_info);
+
+out:
+    /* on success the handle keeps the reference */
+    if (ret)
+        put_path(path_res);
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    pthread_rwlock_unlock(&handles_lock);
+    return ret;
+}
+
+static int echfs_mkdir(const char *path, mode_t mode) {
+    echfs_debug("echfs_mkdir() on %s\n", path);
+    pthread_rwlock_wrlock(&echfs.dir_lock);
+    struct path_result_t *path_res = resolve_path(path);
+    int ret = 0;
+    if (!path_res->failure) {
+        ret = -EEXIST;
+        goto out;
+    }
+
+    uint64_t new_entry;
+    ret = make_entry(path_res->parent_id, path_name(path_res->path),
+            DIRECTORY_TYPE, mode, &new_entry);
+    if (ret)
+        goto out;
+
+    path_res->target_entry = new_entry;
+    path_res->failure = 0;
+    path_res = cache_path(path_res);
+
+out:
+    put_path(path_res);
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    return ret;
+}
+
+/* deletes the file path_res refers to, with handles_lock and dir_lock held
+ * for writing */
+static int unlink_entry(struct path_result_t *path_res) {
+    if (path_entry(path_res)->type == DIRECTORY_TYPE)
+        return -EISDIR;
+
+    /* an open file keeps its blocks, and its handles a private copy of the
+     * entry, until the last handle is released */
+    if (detach_extents(path_res->target_entry)) {
+        path_res->orphan = malloc(sizeof(struct entry_t));
+        if (path_res->orphan)
+            *path_res->orphan = echfs.dir_table[path_res->target_entry];
+    } else {
+        pthread_rwlock_wrlock(&echfs.fat_lock);
+        release_chain(path_entry(path_res)->payload);
+        pthread_rwlock_unlock(&echfs.fat_lock);
+    }
+
+    delete_entry(path_res->target_entry);
+    return 0;
+}
+
+/* deletes the empty directory path_res refers to, with dir_lock held for
+ * writing */
+static int remove_dir(struct path_result_t *path_res) {
+    if (path_entry(path_res)->type == FILE_TYPE)
+        return -ENOTDIR;
+    if (path_res->target_entry == ROOT_ID)
+        return -EBUSY;
+    if (!is_dir_empty(path_entry(path_res)->payload))
+        return -ENOTEMPTY;
+
+    free_dir_id(path_entry(path_res)->payload);
+    delete_entry(path_res->target_entry);
+    return 0;
+}
+
+/* must be called with handles_lock and dir_lock held for writing */
+static int do_unlink(const char *path) {
+    struct path_result_t *path_res = resolve_path(path);
+    int ret = path_res->failure ? -ENOENT : unlink_entry(path_res);
+    if (!ret)
+        remove_cached_path(path);
+    put_path(path_res);
+    return ret;
+}
+
+static int echfs_unlink(const char *path) {
+    pthread_rwlock_wrlock(&handles_lock);
+    pthread_rwlock_wrlock(&echfs.dir_lock);
+    int ret = do_unlink(path);
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    pthread_rwlock_unlock(&handles_lock);
+    return ret;
+}
+
+static int echfs_rmdir(const char *path) {
+    pthread_rwlock_wrlock(&echfs.dir_lock);
+    struct path_result_t *path_res = resolve_path(path);
+    int ret = path_res->failure ? -ENOENT : remove_dir(path_res);
+    if (!ret) {
+        remove_cached_children(path);
+        remove_cached_path(path);
+    }
+    put_path(path_res);
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    return ret;
+}
+
+static int echfs_utimens(const char *path, const struct timespec tv[2]) {
+    echfs_debug("echfs_utimens() on %s\n", path);
+    pthread_rwlock_wrlock(&echfs.dir_lock);
+    struct path_result_t *path_res = resolve_path(path);
+    int ret = 0;
+    if (path_res->failure) {
+        ret = -ENOENT;
+        goto out;
+    }
+
+    path_entry(path_res)->atime = tv[0].tv_sec;
+    path_entry(path_res)->mtime = tv[1].tv_sec;
+
+    sync_entry(path_res);
+
+out:
+    put_path(path_res);
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    return ret;
+}
+
+/*
+ * with handles_lock and dir_lock held for writing. dir_lock is dropped for
+ * a moment so that the extent list can be locked ahead of it; holding
+ * handles_lock keeps the file from being unlinked or renamed meanwhile.
+ */
+static int truncate_entry(struct path_result_t *path_res, uint64_t size) {
+    if (path_entry(path_res)->type != FILE_TYPE)
+        return -EISDIR;
+
+    struct extent_map *extents = get_extents(path_res);
+    if (!extents)
+        return -ENOMEM;
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    pthread_rwlock_wrlock(&extents->lock);
+    pthread_rwlock_wrlock(&echfs.dir_lock);
+    int ret = resize_file(path_res, extents, size);
+    pthread_rwlock_unlock(&extents->lock);
+    put_extents(extents);
+    return ret;
+}
+
+static int echfs_truncate(const char *path, off_t size) {
+    echfs_debug("echfs_truncate() on %s, size %lu\n", path, size);
+    if (size < 0) return -EINVAL;
+    pthread_rwlock_wrlock(&handles_lock);
+    pthread_rwlock_wrlock(&echfs.dir_lock);
+    struct path_result_t *path_res = resolve_path(path);
+    int ret = path_res->failure ? -ENOENT : truncate_entry(path_res, size);
+    put_path(path_res);
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    pthread_rwlock_unlock(&handles_lock);
+    return ret;
+}
+
+static int echfs_ftruncate(const char *path, off_t size,
+        struct fuse_file_info *file_info) {
+    (void) path;
+    echfs_debug("echfs_ftruncate() on handle %lu, size %lu\n",
+            file_info->fh, size);
+    if (file_info->fh >= MAX_HANDLES) return -EBADF;
+    if (size < 0) return -EINVAL;
+    struct echfs_handle_t *handle;
+    pthread_rwlock_rdlock(&handles_lock);
+    int ret = get_file_handle(file_info->fh, &handle);
+    pthread_rwlock_unlock(&handles_lock);
+    if (ret)
+        return ret;
+
+    pthread_rwlock_wrlock(&handle->extents->lock);
+    pthread_rwlock_wrlock(&echfs.dir_lock);
+    ret = resize_file(handle->path_res, handle->extents, size);
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    pthread_rwlock_unlock(&handle->extents->lock);
+    put_file_handle(handle);
+    return ret;
+}
+
+/*
+ * reserves the blocks for a range in one allocation, so that a writer that
+ * announces its size gets a contiguous file. echfs can't mark blocks as
+ * unwritten, so extending the size zeroes the new range; with
+ * FALLOC_FL_KEEP_SIZE the blocks only sit past the end of the file until
+ * it is written or truncated.
+ */
+static int echfs_fallocate(const char *path, int mode, off_t offset,
+        off_t length, struct fuse_file_info *file_info) {
+    (void) path;
+    echfs_debug("echfs_fallocate() on handle %lu, %lu bytes at %lu\n",
+            file_info->fh, length, offset);
+    if (file_info->fh >= MAX_HANDLES) return -EBADF;
+    if (mode & ~FALLOC_FL_KEEP_SIZE) return -EOPNOTSUPP;
+    if (offset < 0 || length <= 0) return -EINVAL;
+
+    struct echfs_handle_t *handle;
+    pthread_rwlock_rdlock(&handles_lock);
+    int ret = get_file_handle(file_info->fh, &handle);
+    pthread_rwlock_unlock(&handles_lock);
+    if (ret)
+        return ret;
+
+    pthread_rwlock_wrlock(&handle->extents->lock);
+    pthread_rwlock_wrlock(&echfs.dir_lock);
+    uint64_t end = offset + length;
+    ret = extend_chain(handle->path_res, handle->extents,
+            (end + echfs.bytes_per_block - 1) / echfs.bytes_per_block);
+    if (!ret && !(mode & FALLOC_FL_KEEP_SIZE) &&
+            end > path_entry(handle->path_res)->size) {
+        struct entry_t *entry = path_entry(handle->path_res);
+        ret = zero_range(handle->extents, entry->size, end);
+        if (!ret) {
+            entry->size = end;
+            entry->ctime = get_time();
+            sync_entry(handle->path_res);
+        }
+    }
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    pthread_rwlock_unlock(&handle->extents->lock);
+    put_file_handle(handle);
+    return ret;
+}
+
+/* only a file can be replaced by a rename, and only by another file */
+static int check_replace(const struct entry_t *entry,
+        const struct entry_t *target) {
+    if (target->type == DIRECTORY_TYPE)
+        return -EISDIR;
+    if (entry->type == DIRECTORY_TYPE)
+        return -ENOTDIR;
+    return 0;
+}
+
+/* gives the entry path_res refers to a new name and parent directory, with
+ * dir_lock held for writing */
+static void move_entry(struct path_result_t *path_res, uint64_t dest_id,
+        const char *new_name) {
+    struct entry_t entry = *path_entry(path_res);
+    entry.parent_id = dest_id;
+    strcpy(entry.name, new_name);
+    wr_entry(&entry, path_res->target_entry);
+    path_res->parent_id = dest_id;
+}
+
+static int echfs_rename(const char *path, const char *new) {
+    echfs_debug("echfs_rename() on %s, %s\n", path, new);
+    pthread_rwlock_wrlock(&handles_lock);
+    pthread_rwlock_wrlock(&echfs.dir_lock);
+    struct path_result_t *path_res = resolve_path(path);
+    struct path_result_t *dest_dir = NULL;
+    int ret = 0;
+    if (path_res->failure) {
+        ret = -ENOENT;
+        goto out;
+    }
+    if (!strcmp(path, new))
+        goto out;
+
+    /* a directory can't be moved below itself */
+    size_t path_len = strlen(path);
+    if (!strncmp(new, path, path_len) && new[path_len] == '/') {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    const char *new_name = strrchr(new, '/');
+    if (!new_name)
+        new_name = new;
+    else
+        new_name++;
+    if (strlen(new_name) >= FILENAME_LEN) {
+        ret = -ENAMETOOLONG;
+        goto out;
+    }
+
+    char dest_path[MAX_PATH_LEN];
+    size_t dest_len = new_name - new;
+    if (dest_len > 1)
+        dest_len--;
+    memcpy(dest_path, new, dest_len);
+    dest_path[dest_len] = '\0';
+    if (!dest_len)
+        strcpy(dest_path, "/");
+
+    dest_dir = resolve_path(dest_path);
+    if (dest_dir->failure || path_entry(dest_dir)->type != DIRECTORY_TYPE) {
+        ret = -ENOENT;
+        goto out;
+    }
+
+    struct path_result_t *target = resolve_path(new);
+    if (!target->failure)
+        ret = check_replace(path_entry(path_res), path_entry(target));
+    put_path(target);
+    if (ret)
+        goto out;
+    ret = do_unlink(new);
+    if (ret && ret != -ENOENT)
+        goto out;
+    ret = 0;
+
+    move_entry(path_res, path_entry(dest_dir)->payload, new_name);
+    rename_cached_path(path_res, new);
+
+out:
+    if (dest_dir)
+        put_path(dest_dir);
+    put_path(path_res);
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    pthread_rwlock_unlock(&handles_lock);
+    return ret;
+}
+
+static int echfs_flush(const char *path, struct fuse_file_info *file_info) {
+    (void) path;
+    echfs_debug("echfs_flush() on handle %lu\n", file_info->fh);
+    return flush_metadata();
+}
+
+static int echfs_fsync(const char *path, int datasync,
+        struct fuse_file_info *file_info) {
+    (void) path;
+    (void) datasync;
+    echfs_debug("echfs_fsync() on handle %lu\n", file_info->fh);
+    int ret = flush_metadata();
+    if (ret)
+        return ret;
+
+    if (echfs.map)
+        ret = msync(echfs.map - echfs.map_delta,
+                echfs.image_size + echfs.map_delta, MS_SYNC);
+    else
+        ret = fdatasync(echfs.fd);
+    return ret ? -EIO : 0;
+}
+
+static struct fuse_operations operations = {
+    .init = echfs_init,
+    .destroy = echfs_destroy,
+    .open = echfs_open,
+    .opendir = echfs_opendir,
+    .fgetattr = echfs_fgetattr,
+    .getattr = echfs_getattr,
+    .readdir = echfs_readdir,
+    .release = echfs_release,
+    .releasedir = echfs_releasedir,
+    .read = echfs_read,
+    .write = echfs_write,
+    .write_buf = echfs_write_buf,
+    .create = echfs_create,
+    .unlink = echfs_unlink,
+    .utimens = echfs_utimens,
+    .truncate = echfs_truncate,
+    .ftruncate = echfs_ftruncate,
+    .fallocate = echfs_fallocate,
+    .mkdir = echfs_mkdir,
+    .rmdir = echfs_rmdir,
+    .rename = echfs_rename,
+    .flush = echfs_flush,
+    .fsync = echfs_fsync,
+    .fsyncdir = echfs_fsync,
+    /* the handle is all an open file or directory needs */
+    .flag_nopath = 1,
+};
+
+/*
+ * the low-level backend. Requests name inodes instead of paths, so only
+ * single components are ever looked up, and the operations on open
+ * handles are shared with the path backend above.
+ */
+static void ll_init(void *data, struct fuse_conn_info *conn) {
+    (void) data;
+    echfs_init(conn);
+}
+
+static void fill_entry(struct fuse_entry_param *param,
+        struct path_result_t *inode) {
+    memset(param, 0, sizeof(struct fuse_entry_param));
+    param->ino = inode->ino;
+    param->generation = inode->ino >> 48;
+    fill_stat(&param->attr, path_entry(inode), inode->target_entry);
+    param->attr.st_ino = inode->ino;
+    param->attr_timeout = param->entry_timeout = echfs.cache_timeout;
+}
 
-    struct path_result_t *path_result = resolve_path(path);
-    if (path_result->failure) {
+/* with dir_lock held */
+static int inode_stat(struct path_result_t *inode, struct stat *stat) {
+    if (inode->failure && !inode->orphan)
         return -ENOENT;
-    }
-
-    stat->st_ino = path_result->target_entry + 1;
-    stat->st_nlink = 1;
-    stat->st_uid = path_result->target.owner;
-    stat->st_gid = path_result->target.group;
-    stat->st_rdev = 0;
-    stat->st_size = path_result->target.size;
-    stat->st_blksize = 512;
-    stat->st_blocks = (stat->st_size + 512 - 1) / 512;
-    stat->st_atim.tv_sec = path_result->target.atime;
-    stat->st_atim.tv_nsec = 0;
-    stat->st_mtim.tv_sec = path_result->target.mtime;
-    stat->st_mtim.tv_nsec = 0;
-    stat->st_ctim.tv_sec = path_result->target.ctime;
-    stat->st_ctim.tv_nsec = 0;
-
-    stat->st_mode = 0;
-    switch (path_result->target.type) {
-        case DIRECTORY_TYPE:
-            stat->st_mode |= S_IFDIR;
-            break;
-        case FILE_TYPE:
-            stat->st_mode |= S_IFREG;
-            break;
-    }
-
-    stat->st_mode |= path_result->target.perms;
+    fill_stat(stat, path_entry(inode), inode->target_entry);
+    stat->st_ino = inode->ino;
     return 0;
 }
 
-static int echfs_readdir(const char *path, void *buf, fuse_fill_dir_t fill,
-        off_t offset, struct fuse_file_info *file_info) {
-    echfs_debug("readdir() on %s and offset %lu\n", path, offset);
-
-    struct echfs_handle_t *handle = &handles[file_info->fh];
-    if (!handle->occupied || file_info->fh >= MAX_HANDLES) return -EBADF;
-    if (handle->path_res->target.type != DIRECTORY_TYPE)
+/* looks `name` up in the directory inode `dir`, with dir_lock held. *slot
+ * is SEARCH_FAILURE if there is no such entry. */
+static int find_child(struct path_result_t *dir, const char *name,
+        uint64_t *slot) {
+    if (dir->failure)
+        return -ENOENT;
+    if (path_entry(dir)->type != DIRECTORY_TYPE)
         return -ENOTDIR;
-
-    uint64_t dir_id = handle->path_res->target.payload;
-    off_t i = offset;
-    for (;; i++) {
-        if (i >= (echfs.dir_size * echfs.entries_per_block)) return 0;
-        struct entry_t *entry = &echfs.dir_table[i];
-        if (!entry->parent_id) return 0;
-        if (entry->parent_id == dir_id) {
-            if(fill(buf, entry->name, NULL, i + 1)) return 0;
-        }
-    }
+    if (strlen(name) >= FILENAME_LEN)
+        return -ENAMETOOLONG;
+    *slot = search(name, path_entry(dir)->payload);
     return 0;
 }
 
-static int echfs_release(const char *path,
-        struct fuse_file_info *file_info) {
-    if (file_info->fh >= MAX_HANDLES) return -EBADF;
-    if (!handles[file_info->fh].occupied) return -EBADF;
-    if (handles[file_info->fh].path_res->type != FILE_TYPE) return -EISDIR;
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    echfs_debug("ll_lookup() on %s in %lu\n", name, parent);
+    struct path_result_t *dir = get_inode(parent);
+    if (!dir) {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
 
-    echfs_debug("released handle for %s\n", path);
-    handles[file_info->fh].occupied = 0;
-    free(handles[file_info->fh].alloc_map);
-    return 0;
-}
+    struct fuse_entry_param param = {0};
+    uint64_t slot;
+    pthread_rwlock_rdlock(&echfs.dir_lock);
+    int ret = find_child(dir, name, &slot);
+    if (!ret && slot != SEARCH_FAILURE) {
+        struct path_result_t *inode = lookup_inode(slot);
+        if (inode)
+            fill_entry(&param, inode);
+        else
+            ret = -ENOMEM;
+    }
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    put_path(dir);
 
-static int echfs_releasedir(const char *path,
-        struct fuse_file_info *file_info) {
-    if (file_info->fh >= MAX_HANDLES) return -EBADF;
-    if (!handles[file_info->fh].occupied) return -EBADF;
-    if (handles[file_info->fh].path_res->type != DIRECTORY_TYPE)
-        return -EISDIR;
+    if (ret) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    /* without an inode number this is a failed lookup the kernel caches */
+    if (!param.ino)
+        param.entry_timeout = echfs.cache_timeout;
+    if (fuse_reply_entry(req, &param) && param.ino)
+        forget_inode(param.ino, 1);
+}
 
-    handles[file_info->fh].occupied = 0;
-    return 0;
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    forget_inode(ino, nlookup);
+    fuse_reply_none(req);
 }
 
-static int echfs_read(const char *path, char *buf, size_t to_read,
-        off_t offset, struct fuse_file_info *file_info) {
-    echfs_debug("echfs_read() on %s, %lu\n", path, to_read);
-    if (file_info->fh >= MAX_HANDLES) return -EBADF;
-    if (!handles[file_info->fh].occupied) return -EBADF;
-    if (handles[file_info->fh].path_res->type != FILE_TYPE) return -EISDIR;
+static void ll_forget_multi(fuse_req_t req, size_t count,
+        struct fuse_forget_data *forgets) {
+    for (size_t i = 0; i < count; i++)
+        forget_inode(forgets[i].ino, forgets[i].nlookup);
+    fuse_reply_none(req);
+}
 
-    struct echfs_handle_t *handle = &handles[file_info->fh];
-    if ((offset + to_read) >= handle->path_res->target.size)
-        to_read = handle->path_res->target.size - offset;
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *file_info) {
+    (void) file_info;
+    struct path_result_t *inode = get_inode(ino);
+    if (!inode) {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
 
-    uint64_t progress = 0;
-    while (progress < to_read) {
-        uint64_t block = (offset + progress) / echfs.bytes_per_block;
-        uint64_t loc = handle->alloc_map[block] * echfs.bytes_per_block;
+    struct stat stat;
+    pthread_rwlock_rdlock(&echfs.dir_lock);
+    int ret = inode_stat(inode, &stat);
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    put_path(inode);
 
-        uint64_t chunk = to_read - progress;
-        uint64_t disk_offset = (offset + progress) % echfs.bytes_per_block;
-        if (chunk > echfs.bytes_per_block - disk_offset)
-            chunk = echfs.bytes_per_block - disk_offset;
+    if (ret)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_attr(req, &stat, echfs.cache_timeout);
+}
 
-        echfs_fseek(echfs.image, loc + disk_offset, SEEK_SET);
-        int ret = fread(buf + progress, 1, chunk, echfs.image);
-        if (ret != chunk)
-            return -EIO;
-        progress += chunk;
+/* like the path backend, echfs-fuse has no chmod or chown */
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+        int to_set, struct fuse_file_info *file_info) {
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+    struct path_result_t *inode = get_inode(ino);
+    if (!inode) {
+        fuse_reply_err(req, ESTALE);
+        return;
     }
 
-    return to_read;
-}
-
-//TODO check if we run out of space..
-static uint64_t allocate_new_block(uint64_t prev_block) {
-    uint64_t i = 0;
-    for (;; i++) {
-        uint64_t block = echfs.fat[i];
-        if (!block) {
-            echfs.fat[i] = END_OF_CHAIN;
-            if (prev_block) {
-                echfs.fat[prev_block] = i;
-            }
-            break;
+    int ret = 0;
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        if (file_info) {
+            ret = echfs_ftruncate(NULL, attr->st_size, file_info);
+        } else if (attr->st_size < 0) {
+            ret = -EINVAL;
+        } else {
+            pthread_rwlock_wrlock(&handles_lock);
+            pthread_rwlock_wrlock(&echfs.dir_lock);
+            ret = inode->failure ? -ENOENT :
+                truncate_entry(inode, attr->st_size);
+            pthread_rwlock_unlock(&echfs.dir_lock);
+            pthread_rwlock_unlock(&handles_lock);
         }
     }
-    return i;
-}
 
-static uint64_t get_block_pos(struct echfs_handle_t *handle, uint64_t block) {
-    if (block >= handle->total_blocks) {
-        uint64_t new_block_count = block + 1;
-        handle->alloc_map = realloc(handle->alloc_map,
-                new_block_count * sizeof(uint64_t));
-        for (uint64_t i = handle->total_blocks; i < new_block_count; i++) {
-            uint64_t new_block = 0;
-            if (!i) {
-                new_block = allocate_new_block(0);
-                handle->path_res->target.payload = new_block;
-            } else {
-                new_block = allocate_new_block(handle->alloc_map[i - 1]);
-            }
-            handle->alloc_map[i] = new_block;
+    int times = FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME |
+        FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW;
+    struct stat stat;
+    if (to_set & times)
+        pthread_rwlock_wrlock(&echfs.dir_lock);
+    else
+        pthread_rwlock_rdlock(&echfs.dir_lock);
+    if (!ret && (to_set & times)) {
+        if (inode->failure && !inode->orphan) {
+            ret = -ENOENT;
+        } else {
+            struct entry_t *entry = path_entry(inode);
+            if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+                entry->atime = get_time();
+            else if (to_set & FUSE_SET_ATTR_ATIME)
+                entry->atime = attr->st_atime;
+            if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+                entry->mtime = get_time();
+            else if (to_set & FUSE_SET_ATTR_MTIME)
+                entry->mtime = attr->st_mtime;
+            sync_entry(inode);
         }
-        handle->total_blocks = new_block_count;
-        wr_entry(&handle->path_res->target,
-                handle->path_res->target_entry);
     }
-    return handle->alloc_map[block];
+    if (!ret)
+        ret = inode_stat(inode, &stat);
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    put_path(inode);
+
+    if (ret)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_attr(req, &stat, echfs.cache_timeout);
 }
 
-static int echfs_write(const char *path, const char *buf, size_t to_write,
-        off_t offset, struct fuse_file_info *file_info) {
-    echfs_debug("echfs_write() on %s\n", path);
-    if (file_info->fh >= MAX_HANDLES) return -EBADF;
-    if (!handles[file_info->fh].occupied) return -EBADF;
-    if (handles[file_info->fh].path_res->type != FILE_TYPE) return -EISDIR;
+/* creates an entry and its inode, with dir_lock held for writing */
+static int ll_make(struct path_result_t *dir, const char *name, int type,
+        mode_t mode, struct path_result_t **inode) {
+    uint64_t slot;
+    int ret = find_child(dir, name, &slot);
+    if (ret)
+        return ret;
+    if (slot != SEARCH_FAILURE)
+        return -EEXIST;
 
-    struct echfs_handle_t *handle = &handles[file_info->fh];
-    int ret = update_mtime(handle->path_res);
-    if (ret) return ret;
+    ret = make_entry(path_entry(dir)->payload, name, type, mode, &slot);
+    if (ret)
+        return ret;
+    *inode = lookup_inode(slot);
+    return *inode ? 0 : -ENOMEM;
+}
 
-    if ((offset + to_write) > handle->path_res->target.size) {
-        handle->path_res->target.size = offset + to_write;
-        wr_entry(&handle->path_res->target,
-                handle->path_res->target_entry);
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+        mode_t mode) {
+    echfs_debug("ll_mkdir() on %s in %lu\n", name, parent);
+    struct path_result_t *dir = get_inode(parent);
+    if (!dir) {
+        fuse_reply_err(req, ESTALE);
+        return;
     }
 
-    uint64_t progress = 0;
-    while (progress < to_write) {
-        uint64_t block = (offset + progress) / echfs.bytes_per_block;
-        uint64_t loc = get_block_pos(handle, block) * echfs.bytes_per_block;
+    struct fuse_entry_param param;
+    struct path_result_t *inode;
+    pthread_rwlock_wrlock(&echfs.dir_lock);
+    int ret = ll_make(dir, name, DIRECTORY_TYPE, mode, &inode);
+    if (!ret)
+        fill_entry(&param, inode);
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    put_path(dir);
+
+    if (ret)
+        fuse_reply_err(req, -ret);
+    else if (fuse_reply_entry(req, &param))
+        forget_inode(param.ino, 1);
+}
 
-        uint64_t chunk = to_write - progress;
-        uint64_t buf_offset = (offset + progress) % echfs.bytes_per_block;
-        if (chunk > echfs.bytes_per_block - buf_offset)
-            chunk = echfs.bytes_per_block - buf_offset;
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+        mode_t mode, struct fuse_file_info *file_info) {
+    echfs_debug("ll_create() on %s in %lu\n", name, parent);
+    struct path_result_t *dir = get_inode(parent);
+    if (!dir) {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
 
-        echfs_fseek(echfs.image, loc + buf_offset, SEEK_SET);
-        ret = fwrite(buf + progress, 1, chunk, echfs.image);
-        if (ret != chunk)
-            return -EIO;
-        progress += chunk;
+    struct fuse_entry_param param;
+    struct path_result_t *inode;
+    pthread_rwlock_wrlock(&handles_lock);
+    pthread_rwlock_wrlock(&echfs.dir_lock);
+    int ret = ll_make(dir, name, FILE_TYPE, mode, &inode);
+    if (!ret) {
+        fill_entry(&param, inode);
+        /* the handle's reference */
+        __atomic_add_fetch(&inode->refs, 1, __ATOMIC_RELAXED);
+        ret = open_file(inode, file_info);
+        if (ret) {
+            put_path(inode);
+            forget_inode(param.ino, 1);
+        }
     }
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    pthread_rwlock_unlock(&handles_lock);
+    put_path(dir);
 
-    return to_write;
+    if (ret) {
+        fuse_reply_err(req, -ret);
+    } else if (fuse_reply_create(req, &param, file_info)) {
+        /* the open was interrupted */
+        echfs_release(NULL, file_info);
+        forget_inode(param.ino, 1);
+    }
 }
 
-static uint64_t find_free_entry() {
-    uint64_t i = 0;
-    struct entry_t entry;
-    for (; ; i++) {
-        if (i >= (echfs.dir_size * echfs.entries_per_block))
-            return SEARCH_FAILURE;
-        entry = echfs.dir_table[i];
-        if (!entry.parent_id) break;
-        if (entry.parent_id == DELETED_ENTRY) break;
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    echfs_debug("ll_unlink() on %s in %lu\n", name, parent);
+    struct path_result_t *dir = get_inode(parent);
+    if (!dir) {
+        fuse_reply_err(req, ESTALE);
+        return;
     }
 
-    return i;
+    uint64_t slot;
+    pthread_rwlock_wrlock(&handles_lock);
+    pthread_rwlock_wrlock(&echfs.dir_lock);
+    int ret = find_child(dir, name, &slot);
+    if (!ret && slot == SEARCH_FAILURE)
+        ret = -ENOENT;
+    if (!ret) {
+        struct path_result_t stray;
+        struct path_result_t *inode = get_slot_inode(slot, &stray);
+        ret = unlink_entry(inode);
+        put_slot_inode(inode, &stray, !ret);
+    }
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    pthread_rwlock_unlock(&handles_lock);
+    put_path(dir);
+    fuse_reply_err(req, -ret);
 }
 
-static int echfs_create(const char *path, mode_t mode,
-        struct fuse_file_info *file_info) {
-    echfs_debug("echfs_create() on %s\n", path);
-    struct path_result_t *path_res = resolve_path(path);
-    if (!path_res->failure)
-        return -EEXIST;
-
-    struct entry_t entry = {0};
-    entry.parent_id = path_res->parent.payload;
-    entry.type = FILE_TYPE;
-    strcpy(entry.name, path_res->name);
-    entry.perms = mode;
-    entry.payload = END_OF_CHAIN;
-    entry.ctime = entry.atime = entry.mtime = get_time();
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    echfs_debug("ll_rmdir() on %s in %lu\n", name, parent);
+    struct path_result_t *dir = get_inode(parent);
+    if (!dir) {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
 
-    uint64_t new_entry = find_free_entry();
-    if (new_entry == SEARCH_FAILURE) return -EIO;
-    wr_entry(&entry, new_entry);
+    uint64_t slot;
+    pthread_rwlock_wrlock(&echfs.dir_lock);
+    int ret = find_child(dir, name, &slot);
+    if (!ret && slot == SEARCH_FAILURE)
+        ret = -ENOENT;
+    if (!ret) {
+        struct path_result_t stray;
+        struct path_result_t *inode = get_slot_inode(slot, &stray);
+        ret = remove_dir(inode);
+        put_slot_inode(inode, &stray, !ret);
+    }
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    put_path(dir);
+    fuse_reply_err(req, -ret);
+}
 
-    path_res->target = entry;
-    path_res->target_entry = new_entry;
-    path_res->type = FILE_TYPE;
-    path_res->failure = 0;
-    cache_path(path_res);
+/* the kernel already refuses to move a directory below itself */
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+        fuse_ino_t new_parent, const char *new_name) {
+    echfs_debug("ll_rename() on %s in %lu, %s in %lu\n", name, parent,
+            new_name, new_parent);
+    struct path_result_t *dir = get_inode(parent);
+    struct path_result_t *dest_dir = get_inode(new_parent);
+    if (!dir || !dest_dir) {
+        if (dir)
+            put_path(dir);
+        if (dest_dir)
+            put_path(dest_dir);
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
 
-    int handle_num = get_handle();
-    if (handle_num < 0) return -ENOMEM;
-    file_info->fh = handle_num;
+    uint64_t slot, dest_slot;
+    pthread_rwlock_wrlock(&handles_lock);
+    pthread_rwlock_wrlock(&echfs.dir_lock);
+    int ret = find_child(dir, name, &slot);
+    if (!ret && slot == SEARCH_FAILURE)
+        ret = -ENOENT;
+    if (!ret)
+        ret = find_child(dest_dir, new_name, &dest_slot);
+    if (ret || dest_slot == slot)
+        goto out;
+
+    struct path_result_t stray;
+    struct path_result_t *inode;
+    if (dest_slot != SEARCH_FAILURE) {
+        ret = check_replace(&echfs.dir_table[slot],
+                &echfs.dir_table[dest_slot]);
+        if (ret)
+            goto out;
+        inode = get_slot_inode(dest_slot, &stray);
+        ret = unlink_entry(inode);
+        put_slot_inode(inode, &stray, !ret);
+        if (ret)
+            goto out;
+    }
 
-    struct echfs_handle_t *handle = &handles[file_info->fh];
-    handle->path_res = path_res;
-    handle->occupied = 1;
-    handle->alloc_map = NULL;
+    inode = get_slot_inode(slot, &stray);
+    move_entry(inode, path_entry(dest_dir)->payload, new_name);
+    put_slot_inode(inode, &stray, 0);
 
-    handle->total_blocks = 0;
-    return 0;
+out:
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    pthread_rwlock_unlock(&handles_lock);
+    put_path(dir);
+    put_path(dest_dir);
+    fuse_reply_err(req, -ret);
 }
 
-static uint64_t find_free_dir_id() {
-    uint64_t id = 1;
-    uint64_t i = 0;
-    struct entry_t entry = {0};
-
-    for (; ; i++) {
-        if (i >= (echfs.dir_size * echfs.entries_per_block))
-            return SEARCH_FAILURE;
-        entry = echfs.dir_table[i];
-        if (!entry.parent_id) break;
-        if (entry.parent_id == DELETED_ENTRY) continue;
-        if ((entry.type == 1) && (entry.payload == id))
-            id = (entry.payload + 1);
+static void ll_open(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *file_info) {
+    struct path_result_t *inode = get_inode(ino);
+    if (!inode) {
+        fuse_reply_err(req, ESTALE);
+        return;
     }
 
-    return id;
+    pthread_rwlock_wrlock(&handles_lock);
+    pthread_rwlock_rdlock(&echfs.dir_lock);
+    int ret = inode->failure ? -ENOENT : open_file(inode, file_info);
+    /* on success the handle keeps the reference */
+    if (ret)
+        put_path(inode);
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    pthread_rwlock_unlock(&handles_lock);
+
+    if (ret)
+        fuse_reply_err(req, -ret);
+    else if (fuse_reply_open(req, file_info))
+        echfs_release(NULL, file_info);
 }
 
-static int echfs_mkdir(const char *path, mode_t mode) {
-    echfs_debug("echfs_mkdir() on %s\n", path);
-    struct path_result_t *path_res = resolve_path(path);
-    if (!path_res->failure)
-        return -EEXIST;
-
-    uint64_t new_entry = find_free_entry();
-    if (new_entry == SEARCH_FAILURE) return -EIO;
-    uint64_t new_dir_id = find_free_dir_id();
-    if (new_dir_id == SEARCH_FAILURE) return -EIO;
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *file_info) {
+    struct path_result_t *inode = get_inode(ino);
+    if (!inode) {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
 
-    struct entry_t entry = {0};
-    entry.parent_id = path_res->parent.payload;
-    entry.type = DIRECTORY_TYPE;
-    strcpy(entry.name, path_res->name);
-    entry.perms = mode;
-    entry.payload = new_dir_id;
-    entry.atime = entry.mtime = entry.ctime = get_time();
+    pthread_rwlock_wrlock(&handles_lock);
+    pthread_rwlock_rdlock(&echfs.dir_lock);
+    int ret = inode->failure ? -ENOENT : open_dir(inode, file_info);
+    if (ret)
+        put_path(inode);
+    pthread_rwlock_unlock(&echfs.dir_lock);
+    pthread_rwlock_unlock(&handles_lock);
+
+    if (ret)
+        fuse_reply_err(req, -ret);
+    else if (fuse_reply_open(req, file_info))
+        echfs_releasedir(NULL, file_info);
+}
 
-    wr_entry(&entry, new_entry);
+struct dir_buffer {
+    fuse_req_t req;
+    char *buf;
+    size_t size;
+    size_t used;
+};
 
-    path_res->target_entry = new_entry;
-    path_res->target = entry;
-    path_res->failure = 0;
-    path_res->type = DIRECTORY_TYPE;
+static int fill_dir_buffer(void *data, const char *name,
+        const struct stat *stat, off_t offset) {
+    struct dir_buffer *dir = data;
+    struct stat parent = { .st_mode = S_IFDIR };
+    size_t len = fuse_add_direntry(dir->req, dir->buf + dir->used,
+            dir->size - dir->used, name, stat ? stat : &parent, offset);
+    if (len > dir->size - dir->used)
+        return 1;
+    dir->used += len;
     return 0;
 }
 
-static int echfs_unlink(const char *path) {
-    struct path_result_t *path_res = resolve_path(path);
-    if (path_res->failure)
-        return -ENOENT;
-    if (path_res->type == DIRECTORY_TYPE)
-        return -EISDIR;
-
-    uint64_t empty = 0;
-    uint64_t block = path_res->target.payload;
-    if (block != END_OF_CHAIN) {
-        for (;;) {
-            uint64_t next_block = echfs.fat[block];
-            echfs.fat[block] = empty;
-            if (next_block == END_OF_CHAIN)
-                break;
-            block = next_block;
-        }
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+        off_t offset, struct fuse_file_info *file_info) {
+    (void) ino;
+    struct dir_buffer dir = { req, malloc(size), size, 0 };
+    if (!dir.buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
     }
-
-    struct entry_t deleted_entry = {0};
-    deleted_entry.parent_id = DELETED_ENTRY;
-    wr_entry(&deleted_entry, path_res->target_entry);
-    remove_cached_path(path);
-    return 0;
+    int ret = echfs_readdir(NULL, &dir, fill_dir_buffer, offset, file_info);
+    if (ret)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_buf(req, dir.buf, dir.used);
+    free(dir.buf);
 }
 
-static int echfs_rmdir(const char *path) {
-    struct path_result_t *path_res = resolve_path(path);
-    if (path_res->failure)
-        return -ENOENT;
-    if (path_res->type == FILE_TYPE)
-        return -ENOTDIR;
+/*
+ * the reply is spliced from the image while the extent list is still held,
+ * so the blocks can't be freed and handed to another file under it.
+ */
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+        off_t offset, struct fuse_file_info *file_info) {
+    (void) ino;
+    echfs_debug("ll_read() on handle %lu, %lu\n", file_info->fh, size);
+    if (echfs.cache_size) {
+        /* cached blocks may be newer than the image, copy through them */
+        char *buf = malloc(size);
+        if (!buf) {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        }
+        int ret = echfs_read(NULL, buf, size, offset, file_info);
+        if (ret < 0)
+            fuse_reply_err(req, -ret);
+        else
+            fuse_reply_buf(req, buf, ret);
+        free(buf);
+        return;
+    }
 
-    int ret = is_dir_empty(path_res->target.payload);
-    if (ret < 0) return ret;
-    if (!ret) return -ENOTEMPTY;
+    struct echfs_handle_t *handle;
+    int ret = begin_read(file_info, offset, &size, &handle);
+    if (ret) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
 
-    struct entry_t deleted_entry = {0};
-    deleted_entry.parent_id = DELETED_ENTRY;
-    wr_entry(&deleted_entry, path_res->target_entry);
-    remove_cached_path(path);
-    return 0;
+    struct fuse_bufvec *runs = NULL;
+    ret = file_runs(handle->extents, offset, size, &runs);
+    if (ret)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_data(req, runs, 0);
+    end_read(handle);
+    free(runs);
 }
 
-static int echfs_utimens(const char *path, const struct timespec tv[2]) {
-    echfs_debug("echfs_utimens() on %s\n", path);
-    struct path_result_t *path_res = resolve_path(path);
-
-    path_res->target.atime = tv[0].tv_sec;
-    path_res->target.mtime = tv[1].tv_sec;
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+        size_t size, off_t offset, struct fuse_file_info *file_info) {
+    (void) ino;
+    int ret = echfs_write(NULL, buf, size, offset, file_info);
+    if (ret < 0)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_write(req, ret);
+}
 
-    wr_entry(&path_res->target, path_res->target_entry);
-    return 0;
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_bufvec *buf, off_t offset,
+        struct fuse_file_info *file_info) {
+    (void) ino;
+    int ret = echfs_write_buf(NULL, buf, offset, file_info);
+    if (ret < 0)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_write(req, ret);
 }
 
-//TODO: free the blocks too
-static int echfs_truncate(const char *path, off_t size) {
-    echfs_debug("echfs_truncate() on %s, size %lu\n", path, size);
-    struct path_result_t *path_res = resolve_path(path);
-    update_ctime(path_res);
-    path_res->target.size = size;
-    wr_entry(&path_res->target, path_res->target_entry);
-    return 0;
+static void ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+        off_t offset, off_t length, struct fuse_file_info *file_info) {
+    (void) ino;
+    fuse_reply_err(req, -echfs_fallocate(NULL, mode, offset, length,
+                file_info));
 }
 
-static int echfs_ftruncate(const char *path, off_t size,
+static void ll_release(fuse_req_t req, fuse_ino_t ino,
         struct fuse_file_info *file_info) {
-    echfs_debug("echfs_ftruncate() on %s, size %lu\n", path, size);
-    if (file_info->fh >= MAX_HANDLES) return -EBADF;
-    if (!handles[file_info->fh].occupied) return -EBADF;
-    if (handles[file_info->fh].path_res->type != FILE_TYPE) return -EISDIR;
-
-    struct echfs_handle_t *handle = &handles[file_info->fh];
-    handle->path_res->target.size = size;
-    update_ctime(handle->path_res);
-    wr_entry(&handle->path_res->target,
-            handle->path_res->target_entry);
-    return 0;
+    (void) ino;
+    fuse_reply_err(req, -echfs_release(NULL, file_info));
 }
 
-static int echfs_rename(const char *path, const char *new) {
-    echfs_debug("echfs_rename() on %s, %s\n", path, new);
-    struct path_result_t *path_res = resolve_path(path);
-    if (path_res->failure)
-        return -ENOENT;
-
-    echfs_unlink(new);
-
-    const char *new_name = strrchr(new, '/');
-    if (!new_name)
-        new_name = new;
-    else
-        new_name++;
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *file_info) {
+    (void) ino;
+    fuse_reply_err(req, -echfs_releasedir(NULL, file_info));
+}
 
-    strcpy(path_res->target.name, new_name);
-    wr_entry(&path_res->target, path_res->target_entry);
+static void ll_flush(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *file_info) {
+    (void) ino;
+    fuse_reply_err(req, -echfs_flush(NULL, file_info));
+}
 
-    strcpy(path_res->name, new_name);
-    strcpy(path_res->path, new);
-    rehash_path(path, new);
-    return 0;
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+        struct fuse_file_info *file_info) {
+    (void) ino;
+    fuse_reply_err(req, -echfs_fsync(NULL, datasync, file_info));
 }
 
-static struct fuse_operations operations = {
-    .init = echfs_init,
+static struct fuse_lowlevel_ops ll_operations = {
+    .init = ll_init,
     .destroy = echfs_destroy,
-    .open = echfs_open,
-    .opendir = echfs_opendir,
-    .fgetattr = echfs_fgetattr,
-    .getattr = echfs_getattr,
-    .readdir = echfs_readdir,
-    .release = echfs_release,
-    .releasedir = echfs_releasedir,
-    .read = echfs_read,
-    .write = echfs_write,
-    .create = echfs_create,
-    .unlink = echfs_unlink,
-    .utimens = echfs_utimens,
-    .truncate = echfs_truncate,
-    .ftruncate = echfs_ftruncate,
-    .mkdir = echfs_mkdir,
-    .rmdir = echfs_rmdir,
-    .rename = echfs_rename,
+    .lookup = ll_lookup,
+    .forget = ll_forget,
+    .forget_multi = ll_forget_multi,
+    .getattr = ll_getattr,
+    .setattr = ll_setattr,
+    .mkdir = ll_mkdir,
+    .create = ll_create,
+    .unlink = ll_unlink,
+    .rmdir = ll_rmdir,
+    .rename = ll_rename,
+    .open = ll_open,
+    .opendir = ll_opendir,
+    .readdir = ll_readdir,
+    .read = ll_read,
+    .write = ll_write,
+    .write_buf = ll_write_buf,
+    .fallocate = ll_fallocate,
+    .release = ll_release,
+    .releasedir = ll_releasedir,
+    .flush = ll_flush,
+    .fsync = ll_fsync,
+    .fsyncdir = ll_fsync,
 };
 
 static struct options {
@@ -1054,6 +4019,16 @@ static struct options {
     int mbr;
     int gpt;
     int partition;
+    int single_thread;
+    int mmap;
+    unsigned flush_interval;
+    unsigned path_cache_size;
+    unsigned cache_timeout;
+    unsigned readahead;
+    char *cache_size;
+    int compact;
+    int lowlevel;
+    int writeback_cache;
 } options;
 
 #define OPTION(t, p)    \
@@ -1065,6 +4040,16 @@ static const struct fuse_opt option_spec[] = {
     OPTION("--mbr", mbr),
     OPTION("--gpt", gpt),
     OPTION("-p %i", partition),
+    OPTION("-s", single_thread),
+    OPTION("--mmap", mmap),
+    OPTION("--flush-interval=%u", flush_interval),
+    OPTION("--path-cache-size=%u", path_cache_size),
+    OPTION("--cache-timeout=%u", cache_timeout),
+    OPTION("--readahead=%u", readahead),
+    OPTION("cache_size=%s", cache_size),
+    OPTION("--compact", compact),
+    OPTION("--lowlevel", lowlevel),
+    OPTION("--writeback-cache", writeback_cache),
     FUSE_OPT_END
 };
 
@@ -1085,12 +4070,70 @@ static int option_cb(void *data, const char *arg, int key,
     return 1;
 }
 
+/* parses a byte count with an optional K, M or G suffix */
+static int parse_size(const char *str, uint64_t *size) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (errno || end == str)
+        return -1;
+    switch (*end) {
+        case 'k': case 'K': value <<= 10; end++; break;
+        case 'm': case 'M': value <<= 20; end++; break;
+        case 'g': case 'G': value <<= 30; end++; break;
+    }
+    if (*end)
+        return -1;
+    *size = value;
+    return 0;
+}
+
 static void show_help(const char *program_name) {
     printf("usage: %s [options] <echfs image> <mountpoint>\n", program_name);
 }
 
+/* the low-level backend passes the cache timeouts with every reply */
+static int run_lowlevel(struct fuse_args *args) {
+    struct fuse_chan *chan = fuse_mount(echfs.mountpoint, args);
+    if (!chan)
+        return 1;
+
+    struct fuse_session *session = fuse_lowlevel_new(args, &ll_operations,
+            sizeof(struct fuse_lowlevel_ops), NULL);
+    if (!session) {
+        fprintf(stderr, "Error initializing fuse!\n");
+        fuse_unmount(echfs.mountpoint, chan);
+        return 1;
+    }
+
+    int ret = fuse_set_signal_handlers(session);
+    if (ret) {
+        fuse_session_destroy(session);
+        fuse_unmount(echfs.mountpoint, chan);
+        return 1;
+    }
+    fuse_session_add_chan(session, chan);
+
+    echfs.chan = chan;
+    echfs.session = session;
+
+    fuse_daemonize(options.debug);
+    if (options.single_thread)
+        ret = fuse_session_loop(session);
+    else
+        ret = fuse_session_loop_mt(session);
+
+    cleanup_fuse();
+    fuse_session_destroy(session);
+    return ret;
+}
+
 int main(int argc, char **argv) {
     echfs.image_path = echfs.mountpoint = 0;
+    options.flush_interval = 5;
+    options.path_cache_size = 4096;
+    options.cache_timeout = 30;
+    options.readahead = 1024;
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
     if (fuse_opt_parse(&args, &options, option_spec, option_cb)) {
@@ -1119,6 +4162,53 @@ int main(int argc, char **argv) {
     echfs.mbr = options.mbr;
     echfs.gpt = options.gpt;
     echfs.partition = options.partition;
+    echfs.use_mmap = options.mmap;
+    echfs.flush_interval = options.flush_interval;
+    echfs.compact = options.compact;
+    echfs.path_cache_size = options.path_cache_size ?
+        options.path_cache_size : 1;
+    echfs.cache_timeout = options.cache_timeout;
+    echfs.readahead = (uint64_t)options.readahead * 1024;
+    if (options.cache_size && parse_size(options.cache_size,
+                &echfs.cache_size)) {
+        fprintf(stderr, "Invalid cache_size: %s\n", options.cache_size);
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+    free(options.cache_size);
+    if (echfs.cache_size && echfs.use_mmap) {
+        fprintf(stderr, "warning: the block cache is not used with --mmap, "
+                "ignoring cache_size\n");
+        echfs.cache_size = 0;
+    }
+    echfs.lowlevel = options.lowlevel;
+    echfs.writeback_cache = options.writeback_cache;
+#ifndef FUSE_CAP_WRITEBACK_CACHE
+    if (echfs.writeback_cache)
+        fprintf(stderr, "warning: libfuse has no writeback cache support, "
+                "ignoring --writeback-cache\n");
+#endif
+
+    if (echfs.lowlevel) {
+        int ret = run_lowlevel(&args);
+        fuse_opt_free_args(&args);
+        return ret;
+    }
+
+    /*
+     * every change to the image goes through this process, so the kernel
+     * can keep attributes and lookups for a while. Inserted first, so that
+     * an explicit -o on the command line still wins.
+     */
+    char timeouts[128];
+    snprintf(timeouts, sizeof(timeouts),
+            "-oentry_timeout=%u,attr_timeout=%u,negative_timeout=%u",
+            options.cache_timeout, options.cache_timeout,
+            options.cache_timeout);
+    if (fuse_opt_insert_arg(&args, 1, timeouts)) {
+        fuse_opt_free_args(&args);
+        return 1;
+    }
 
     struct fuse_chan *chan = fuse_mount(echfs.mountpoint, &args);
     if (!chan) {
@@ -1146,7 +4236,10 @@ int main(int argc, char **argv) {
     echfs.session = session;
 
     fuse_daemonize(options.debug);
-    ret = fuse_loop(fuse);
+    if (options.single_thread)
+        ret = fuse_loop(fuse);
+    else
+        ret = fuse_loop_mt(fuse);
 
     cleanup_fuse();
     fuse_destroy(fuse);
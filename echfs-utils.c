@@ -1,3 +1,7 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -6,9 +10,18 @@
 #include <inttypes.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <uuid/uuid.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 #include "part.h"
 
@@ -26,6 +39,7 @@
 #define DELETED_ENTRY           0xfffffffffffffffe
 #define RESERVED_BLOCK          0xfffffffffffffff0
 #define END_OF_CHAIN            0xffffffffffffffff
+#define COPY_BUF_SIZE           (4 << 20)
 
 typedef struct {
     uint64_t parent_id;
@@ -55,8 +69,12 @@ static int mbr = 0;
 static int gpt = 0;
 static int part = 0;
 static int force = 0;
+static int use_mmap = 0;
+static int jobs = 0;
 
 static FILE* image;
+static uint8_t *image_map;
+static uint64_t map_delta;
 static uint64_t part_offset;
 static uint64_t imgsize;
 static uint64_t blocks;
@@ -67,61 +85,126 @@ static uint64_t dirstart;
 static uint64_t datastart;
 static uint64_t bytesperblock;
 
+// live part of the directory, up to the end-of-directory marker. With
+// --mmap this points straight into the mapped directory region.
+static entry_t *dir_table;
+static uint64_t dir_entries;
+static uint64_t dir_capacity;
+
+// hash index of dir_table keyed by (parent_id, name), chained by slot + 1
+static uint64_t *index_buckets;
+static uint64_t *index_chain;
+static uint64_t index_mask;
+static uint64_t index_count;
+
+// directory IDs from this one on are unused
+static uint64_t next_dir_id;
+
+// in-memory allocation table, loaded once for the commands that allocate
+// or follow chains. With --mmap this points straight into the mapped
+// table, otherwise fat_dirty flags the table blocks that need writing back.
+static uint64_t *fat;
+static uint8_t *fat_dirty;
+static uint64_t free_blocks;
+static uint64_t alloc_cursor;
+
 inline static int echfs_fseek(FILE *file, long loc, int mode) {
     return fseek(file, loc + part_offset, mode);
 }
 
-static inline uint8_t rd_byte(uint64_t loc) {
+static int map_image(void) {
+    uint64_t page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    map_delta = part_offset % page_size;
+    void *base = mmap(NULL, imgsize + map_delta, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fileno(image), (off_t)(part_offset - map_delta));
+    if (base == MAP_FAILED)
+        return -1;
+    image_map = (uint8_t *)base + map_delta;
+    return 0;
+}
+
+static void unmap_image(void) {
+    msync(image_map - map_delta, imgsize + map_delta, MS_SYNC);
+    munmap(image_map - map_delta, imgsize + map_delta);
+    image_map = NULL;
+}
+
+static inline void rd_image(void *buf, uint64_t len, uint64_t loc) {
+    if (image_map) {
+        if (loc + len > imgsize) {
+            fprintf(stderr, "PANIC! ATTEMPTING TO READ PAST THE END OF THE IMAGE!\n");
+            abort();
+        }
+        memcpy(buf, image_map + loc, len);
+        return;
+    }
     echfs_fseek(image, (long)loc, SEEK_SET);
-    return (uint8_t)fgetc(image);
+    fread(buf, len, 1, image);
 }
 
-static inline void wr_byte(uint64_t loc, uint8_t x) {
+static inline void wr_image(const void *buf, uint64_t len, uint64_t loc) {
+    if (image_map) {
+        if (loc + len > imgsize) {
+            fprintf(stderr, "PANIC! ATTEMPTING TO WRITE PAST THE END OF THE IMAGE!\n");
+            abort();
+        }
+        memcpy(image_map + loc, buf, len);
+        return;
+    }
     echfs_fseek(image, (long)loc, SEEK_SET);
-    fputc((int)x, image);
+    fwrite(buf, len, 1, image);
+}
+
+static inline uint8_t rd_byte(uint64_t loc) {
+    uint8_t x = 0;
+    rd_image(&x, 1, loc);
+    return x;
+}
+
+static inline void wr_byte(uint64_t loc, uint8_t x) {
+    wr_image(&x, 1, loc);
     return;
 }
 
 static inline uint16_t rd_word(uint64_t loc) {
     uint16_t x = 0;
-    echfs_fseek(image, (long)loc, SEEK_SET);
-    fread(&x, 2, 1, image);
+    rd_image(&x, 2, loc);
     return x;
 }
 
 static inline void wr_word(uint64_t loc, uint16_t x) {
-    echfs_fseek(image, (long)loc, SEEK_SET);
-    fwrite(&x, 2, 1, image);
+    wr_image(&x, 2, loc);
     return;
 }
 
 static inline uint32_t rd_dword(uint64_t loc) {
     uint32_t x = 0;
-    echfs_fseek(image, (long)loc, SEEK_SET);
-    fread(&x, 4, 1, image);
+    rd_image(&x, 4, loc);
     return x;
 }
 
 static inline void wr_dword(uint64_t loc, uint32_t x) {
-    echfs_fseek(image, (long)loc, SEEK_SET);
-    fwrite(&x, 4, 1, image);
+    wr_image(&x, 4, loc);
     return;
 }
 
 static inline uint64_t rd_qword(uint64_t loc) {
     uint64_t x = 0;
-    echfs_fseek(image, (long)loc, SEEK_SET);
-    fread(&x, 8, 1, image);
+    rd_image(&x, 8, loc);
     return x;
 }
 
 static inline void wr_qword(uint64_t loc, uint64_t x) {
-    echfs_fseek(image, (long)loc, SEEK_SET);
-    fwrite(&x, 8, 1, image);
+    wr_image(&x, 8, loc);
     return;
 }
 
 static inline void rd_entry(entry_t *res, uint64_t entry) {
+    if (entry < dir_entries) {
+        *res = dir_table[entry];
+        return;
+    }
+
     uint64_t loc = (dirstart * bytesperblock) + (entry * sizeof(entry_t));
 
     if (loc >= (dirstart + dirsize) * bytesperblock) {
@@ -129,133 +212,451 @@ static inline void rd_entry(entry_t *res, uint64_t entry) {
         abort();
     }
 
-    echfs_fseek(image, (long)loc, SEEK_SET);
-    fread(res, sizeof(entry_t), 1, image);
+    rd_image(res, sizeof(entry_t), loc);
 }
 
-static inline void wr_entry(uint64_t entry, entry_t *entry_src) {
-    uint64_t loc = (dirstart * bytesperblock) + (entry * sizeof(entry_t));
+static inline uint64_t hash_child(uint64_t parent, const char *name) {
+    uint64_t hash = 5381;
+    int c;
+    while ((c = *name++))
+        hash = ((hash << 5) + hash) + c;
+    return hash ^ (parent * 0x9e3779b97f4a7c15);
+}
 
-    if (loc >= (dirstart + dirsize) * BYTES_PER_BLOCK) {
-        fprintf(stderr, "PANIC! ATTEMPTING TO WRITE DIRECTORY OUT OF BOUNDS!\n");
+static inline int is_live_entry(const entry_t *entry) {
+    return entry->parent_id && entry->parent_id != DELETED_ENTRY;
+}
+
+static void index_link(uint64_t entry) {
+    uint64_t bucket = hash_child(dir_table[entry].parent_id, dir_table[entry].name) & index_mask;
+    index_chain[entry] = index_buckets[bucket];
+    index_buckets[bucket] = entry + 1;
+}
+
+static void index_rebuild(uint64_t size) {
+    free(index_buckets);
+    index_buckets = calloc(size, sizeof(uint64_t));
+    if (!index_buckets) {
+        perror("calloc failure");
         abort();
     }
+    index_mask = size - 1;
 
-    echfs_fseek(image, (long)loc, SEEK_SET);
-    fwrite(entry_src, sizeof(entry_t), 1, image);
+    for (uint64_t i = 0; i < dir_entries; i++) {
+        if (is_live_entry(&dir_table[i]))
+            index_link(i);
+    }
 }
 
-static uint64_t import_chain(FILE *source) {
-    uint8_t *block_buf = malloc(bytesperblock);
-    if (!block_buf) {
-        perror("malloc failure");
-        abort();
+static void index_remove(uint64_t entry) {
+    uint64_t bucket = hash_child(dir_table[entry].parent_id, dir_table[entry].name) & index_mask;
+    for (uint64_t *link = &index_buckets[bucket]; *link; link = &index_chain[*link - 1]) {
+        if (*link == entry + 1) {
+            *link = index_chain[entry];
+            index_count--;
+            return;
+        }
     }
+}
 
-    fseek(source, 0L, SEEK_END);
-    uint64_t source_size = (uint64_t)ftell(source);
-    rewind(source);
+static void dir_table_update(uint64_t entry, entry_t *entry_src) {
+    if (entry >= dir_capacity) {
+        uint64_t new_capacity = dir_capacity * 2;
+        while (new_capacity <= entry)
+            new_capacity *= 2;
+        dir_table = realloc(dir_table, new_capacity * sizeof(entry_t));
+        index_chain = realloc(index_chain, new_capacity * sizeof(uint64_t));
+        if (!dir_table || !index_chain) {
+            perror("realloc failure");
+            abort();
+        }
+        memset(dir_table + dir_capacity, 0, (new_capacity - dir_capacity) * sizeof(entry_t));
+        dir_capacity = new_capacity;
+    }
 
-    if (!source_size)
-        return END_OF_CHAIN;
+    entry_t *old = &dir_table[entry];
+    int relink = is_live_entry(old) != is_live_entry(entry_src)
+              || old->parent_id != entry_src->parent_id
+              || strcmp(old->name, entry_src->name);
+
+    if (relink && is_live_entry(old))
+        index_remove(entry);
+    dir_table[entry] = *entry_src;
+    if (entry >= dir_entries)
+        dir_entries = entry + 1;
+    if (relink && is_live_entry(entry_src)) {
+        if (++index_count > index_mask + 1)
+            index_rebuild((index_mask + 1) * 2);
+        else
+            index_link(entry);
+    }
+}
 
-    uint64_t source_size_blocks = (source_size + bytesperblock - 1) / bytesperblock;
+static void load_dir(void) {
+    uint64_t max_entries = dirsize * ENTRIES_PER_BLOCK;
 
-    if (verbose) {
-        fprintf(stdout, "file size: %" PRIu64 "\n", source_size);
-        fprintf(stdout, "file size in blocks: %" PRIu64 "\n", source_size_blocks);
+    if (image_map) {
+        dir_table = (entry_t *)(image_map + dirstart * bytesperblock);
+        dir_capacity = max_entries;
+        for (dir_entries = 0; dir_entries < max_entries && dir_table[dir_entries].parent_id; dir_entries++);
+        goto build_index;
     }
 
-    uint64_t *blocklist = malloc(source_size_blocks * sizeof(uint64_t));
-    if (!blocklist) {
+    dir_capacity = ENTRIES_PER_BLOCK;
+    dir_table = malloc(dir_capacity * sizeof(entry_t));
+    if (!dir_table) {
         perror("malloc failure");
         abort();
     }
 
-    echfs_fseek(image, fatstart * bytesperblock, SEEK_SET);
-    uint64_t block = 0;
-    for (uint64_t i = 0; i < source_size_blocks; i++) {
-        uint64_t vvv;
-        for ( ; fread(&vvv, sizeof(uint64_t), 1, image), vvv; block++);
-        blocklist[i] = block++;
+    // read the directory a block at a time until the end-of-directory marker
+    echfs_fseek(image, (long)(dirstart * bytesperblock), SEEK_SET);
+    for (dir_entries = 0; dir_entries < max_entries; ) {
+        if (dir_entries + ENTRIES_PER_BLOCK > dir_capacity) {
+            dir_capacity *= 2;
+            dir_table = realloc(dir_table, dir_capacity * sizeof(entry_t));
+            if (!dir_table) {
+                perror("realloc failure");
+                abort();
+            }
+        }
+        if (fread(dir_table + dir_entries, sizeof(entry_t), ENTRIES_PER_BLOCK, image) != ENTRIES_PER_BLOCK)
+            break;
+        uint64_t i;
+        for (i = 0; i < ENTRIES_PER_BLOCK && dir_table[dir_entries + i].parent_id; i++);
+        dir_entries += i;
+        if (i < ENTRIES_PER_BLOCK)
+            break;
     }
+    memset(dir_table + dir_entries, 0, (dir_capacity - dir_entries) * sizeof(entry_t));
 
-    for (uint64_t i = 0; i < source_size_blocks; i++) {
-        echfs_fseek(image, blocklist[i] * bytesperblock, SEEK_SET);
+build_index:
+    index_chain = malloc(dir_capacity * sizeof(uint64_t));
+    if (!index_chain) {
+        perror("malloc failure");
+        abort();
+    }
 
-        // copy block
-        fwrite(block_buf, 1, fread(block_buf, 1, bytesperblock, source), image);
+    index_count = 0;
+    next_dir_id = 1;
+    for (uint64_t i = 0; i < dir_entries; i++) {
+        if (!is_live_entry(&dir_table[i]))
+            continue;
+        index_count++;
+        if (dir_table[i].type == DIRECTORY_TYPE && dir_table[i].payload >= next_dir_id)
+            next_dir_id = dir_table[i].payload + 1;
     }
 
-    for (uint64_t i = 0; ; i++) {
-        echfs_fseek(image, fatstart * bytesperblock + blocklist[i] * sizeof(uint64_t), SEEK_SET);
-        if (i == source_size_blocks - 1) {
-            uint64_t vvv = END_OF_CHAIN;
-            fwrite(&vvv, sizeof(uint64_t), 1, image);
-            break;
+    uint64_t size = 1024;
+    while (size < index_count * 2)
+        size *= 2;
+    index_rebuild(size);
+
+    if (verbose) fprintf(stdout, "loaded %" PRIu64 " directory entries\n", dir_entries);
+}
+
+static inline void wr_entry(uint64_t entry, entry_t *entry_src) {
+    uint64_t loc = (dirstart * bytesperblock) + (entry * sizeof(entry_t));
+
+    if (loc >= (dirstart + dirsize) * BYTES_PER_BLOCK) {
+        fprintf(stderr, "PANIC! ATTEMPTING TO WRITE DIRECTORY OUT OF BOUNDS!\n");
+        abort();
+    }
+
+    // update the index first, with --mmap dir_table is the image itself
+    if (dir_table)
+        dir_table_update(entry, entry_src);
+
+    wr_image(entry_src, sizeof(entry_t), loc);
+}
+
+// positional image I/O, safe to use from the tree worker threads which can't
+// share the stdio stream
+static int pread_image(void *buf, uint64_t len, uint64_t loc) {
+    if (image_map) {
+        if (loc + len > imgsize)
+            return -1;
+        memcpy(buf, image_map + loc, len);
+        return 0;
+    }
+    while (len) {
+        ssize_t ret = pread(fileno(image), buf, len, (off_t)(part_offset + loc));
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        buf = (uint8_t *)buf + ret;
+        len -= (uint64_t)ret;
+        loc += (uint64_t)ret;
+    }
+    return 0;
+}
+
+static int pwrite_image(const void *buf, uint64_t len, uint64_t loc) {
+    if (image_map) {
+        if (loc + len > imgsize)
+            return -1;
+        memcpy(image_map + loc, buf, len);
+        return 0;
+    }
+    while (len) {
+        ssize_t ret = pwrite(fileno(image), buf, len, (off_t)(part_offset + loc));
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        buf = (const uint8_t *)buf + ret;
+        len -= (uint64_t)ret;
+        loc += (uint64_t)ret;
+    }
+    return 0;
+}
+
+static void load_fat(void) {
+    if (image_map) {
+        fat = (uint64_t *)(image_map + fatstart * bytesperblock);
+    } else {
+        fat = malloc(blocks * sizeof(uint64_t));
+        fat_dirty = calloc(fatsize, 1);
+        if (!fat || !fat_dirty) {
+            perror("malloc failure");
+            abort();
         }
-        fwrite(&blocklist[i+1], sizeof(uint64_t), 1, image);
+        rd_image(fat, blocks * sizeof(uint64_t), fatstart * bytesperblock);
     }
 
-    block = blocklist[0];
+    free_blocks = 0;
+    for (uint64_t i = datastart; i < blocks; i++)
+        free_blocks += !fat[i];
+    alloc_cursor = datastart;
+}
 
-    free(blocklist);
-    free(block_buf);
-    return block;
+static inline void wr_fat(uint64_t block, uint64_t value) {
+    fat[block] = value;
+    if (fat_dirty)
+        fat_dirty[block * sizeof(uint64_t) / bytesperblock] = 1;
 }
 
-static void export_chain(FILE *dest, entry_t src) {
-    uint64_t cur_block;
-    uint8_t *block_buf = malloc(bytesperblock);
-    if (!block_buf) {
-        perror("malloc failure");
-        abort();
+// writes back the modified table blocks, a run of them at a time
+static void store_fat(void) {
+    if (!image_map) {
+        for (uint64_t i = 0; i < fatsize; ) {
+            if (!fat_dirty[i]) {
+                i++;
+                continue;
+            }
+            uint64_t j = i;
+            while (j < fatsize && fat_dirty[j])
+                j++;
+            uint64_t start = i * bytesperblock;
+            uint64_t end = j * bytesperblock;
+            if (end > blocks * sizeof(uint64_t))
+                end = blocks * sizeof(uint64_t);
+            wr_image((uint8_t *)fat + start, end - start, fatstart * bytesperblock + start);
+            i = j;
+        }
+        free(fat);
+        free(fat_dirty);
+        fat_dirty = NULL;
     }
+    fat = NULL;
+}
 
-    for (cur_block = src.payload; cur_block != END_OF_CHAIN; ) {
-        echfs_fseek(image, (long)(cur_block * bytesperblock), SEEK_SET);
-        // copy block
-        if (((uint64_t)ftell(dest) + bytesperblock) >= src.size) {
-            fread(block_buf, src.size % bytesperblock, 1, image);
-            fwrite(block_buf, src.size % bytesperblock, 1, dest);
-            break;
-        } else {
-            fread(block_buf, bytesperblock, 1, image);
-            fwrite(block_buf, bytesperblock, 1, dest);
+// looks for `count` free blocks in a row, next-fit from alloc_cursor
+static uint64_t find_free_run(uint64_t count) {
+    uint64_t run = 0;
+    uint64_t i = alloc_cursor;
+    for (uint64_t scanned = 0; scanned < blocks - datastart + count; scanned++, i++) {
+        if (i == blocks) {
+            i = datastart;
+            run = 0;
         }
+        if (fat[i])
+            run = 0;
+        else if (++run == count)
+            return i + 1 - count;
+    }
+    return SEARCH_FAILURE;
+}
 
-        cur_block = rd_qword((fatstart * bytesperblock) + (cur_block * sizeof(uint64_t)));
+// chains `count` free blocks together. A single free run is used when
+// there is one, otherwise the blocks are taken next-fit from alloc_cursor
+// so that files allocated one after the other still end up contiguous.
+static int alloc_chain(uint64_t count, uint64_t *first) {
+    *first = END_OF_CHAIN;
+    if (!count)
+        return 0;
+    if (count > free_blocks)
+        return -1;
+
+    uint64_t run = find_free_run(count);
+    if (run != SEARCH_FAILURE)
+        alloc_cursor = run;
+
+    uint64_t prev = END_OF_CHAIN;
+    for (uint64_t i = 0; i < count; i++) {
+        while (fat[alloc_cursor]) {
+            if (++alloc_cursor == blocks)
+                alloc_cursor = datastart;
+        }
+        if (prev == END_OF_CHAIN)
+            *first = alloc_cursor;
+        else
+            wr_fat(prev, alloc_cursor);
+        prev = alloc_cursor;
+        wr_fat(prev, END_OF_CHAIN);
     }
+    free_blocks -= count;
+    return 0;
+}
 
-    free(block_buf);
-    return;
+#ifdef __linux__
+// lets the kernel move a run from a raw image to the host file. Returns 1,
+// having copied nothing, when the files don't support it.
+static int copy_range_out(FILE *dest, uint64_t len, uint64_t loc) {
+    loff_t off = (loff_t)(part_offset + loc);
+    uint64_t copied = 0;
+    while (copied < len) {
+        ssize_t ret = copy_file_range(fileno(image), &off, fileno(dest), NULL, len - copied, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && !copied && (errno == ENOSYS || errno == EXDEV
+                                || errno == EINVAL || errno == EOPNOTSUPP))
+            return 1;
+        if (ret <= 0)
+            return -1;
+        copied += (uint64_t)ret;
+    }
+    return 0;
 }
+#endif
 
-static void delete_chain(uint64_t payload) {
-    if (payload != END_OF_CHAIN) {
-        uint64_t block = payload;
-        for (;;) {
-            uint64_t next_block = rd_qword((fatstart * bytesperblock) + (block * sizeof(uint64_t)));
-            wr_qword((fatstart * bytesperblock) + (block * sizeof(uint64_t)), 0);
-            if (next_block == END_OF_CHAIN)
-                break;
-            block = next_block;
+// copies a file between the host and its chain, a run of physically
+// contiguous blocks (up to the size of buf) at a time. Only entry->size
+// bytes are copied, the tail of the last block is left alone.
+static int copy_chain(FILE *host, const entry_t *entry, int to_image, uint8_t *buf, uint64_t buf_blocks) {
+    uint64_t done = 0;
+    uint64_t block = entry->payload;
+#ifdef __linux__
+    int kernel_copy = !to_image && !image_map;
+#endif
+
+    while (done < entry->size) {
+        if (block >= blocks)
+            return -1;
+        uint64_t start = block, run = 1;
+        for (block = fat[block]; run < buf_blocks && block == start + run; block = fat[block])
+            run++;
+
+        uint64_t len = run * bytesperblock;
+        if (len > entry->size - done)
+            len = entry->size - done;
+
+#ifdef __linux__
+        if (kernel_copy) {
+            int ret = copy_range_out(host, len, start * bytesperblock);
+            if (!ret) {
+                done += len;
+                continue;
+            }
+            // fall back to read/write, but only before anything went out
+            if (ret < 0 || done)
+                return -1;
+            kernel_copy = 0;
+        }
+#endif
+
+        if (to_image) {
+            // a file that shrank under us is an error, not zero padding
+            if (fread(buf, 1, len, host) != len)
+                return -1;
+            if (pwrite_image(buf, len, start * bytesperblock))
+                return -1;
+        } else {
+            if (pread_image(buf, len, start * bytesperblock))
+                return -1;
+            if (fwrite(buf, 1, len, host) != len)
+                return -1;
         }
+        done += len;
+    }
+
+    return 0;
+}
+
+static void delete_chain(uint64_t payload) {
+    for (uint64_t block = payload; block != END_OF_CHAIN && block < blocks; ) {
+        uint64_t next_block = fat[block];
+        wr_fat(block, 0);
+        free_blocks++;
+        block = next_block;
+    }
+}
+
+// allocates a chain for the source file and copies it in, setting the
+// entry's payload and size. The chain is freed again if the copy fails
+static int import_chain(FILE *source, entry_t *entry) {
+    fseek(source, 0L, SEEK_END);
+    uint64_t source_size = (uint64_t)ftell(source);
+    rewind(source);
+
+    uint64_t source_size_blocks = (source_size + bytesperblock - 1) / bytesperblock;
+
+    if (verbose) {
+        fprintf(stdout, "file size: %" PRIu64 "\n", source_size);
+        fprintf(stdout, "file size in blocks: %" PRIu64 "\n", source_size_blocks);
+    }
+
+    uint64_t payload;
+    if (alloc_chain(source_size_blocks, &payload))
+        return -1;
+    entry->payload = payload;
+    entry->size = source_size;
+
+    uint64_t buf_blocks = COPY_BUF_SIZE / bytesperblock;
+    if (!buf_blocks)
+        buf_blocks = 1;
+    uint8_t *buf = malloc(buf_blocks * bytesperblock);
+    if (!buf) {
+        perror("malloc failure");
+        abort();
+    }
+
+    // the copy bypasses the stdio stream
+    fflush(image);
+    int ret = copy_chain(source, entry, 1, buf, buf_blocks);
+    if (ret)
+        delete_chain(payload);
+
+    free(buf);
+    return ret;
+}
+
+static int export_chain(FILE *dest, entry_t src) {
+    uint64_t buf_blocks = COPY_BUF_SIZE / bytesperblock;
+    if (!buf_blocks)
+        buf_blocks = 1;
+    uint8_t *buf = malloc(buf_blocks * bytesperblock);
+    if (!buf) {
+        perror("malloc failure");
+        abort();
     }
+
+    int ret = copy_chain(dest, &src, 0, buf, buf_blocks);
+
+    free(buf);
+    return ret;
 }
 
 static uint64_t search(const char *name, uint64_t parent, uint8_t type) {
     // returns unique entry #, SEARCH_FAILURE upon failure/not found
-    uint64_t loc = (dirstart * bytesperblock);
-    echfs_fseek(image, (long)loc, SEEK_SET);
-    for (uint64_t i = 0; ; i++) {
-        entry_t entry;
-        fread(&entry, sizeof(entry_t), 1, image);
-        if (!entry.parent_id) return SEARCH_FAILURE;              // check if past last entry
-        if (i >= (dirsize * ENTRIES_PER_BLOCK)) return SEARCH_FAILURE;  // check if past directory table
-        if ((entry.parent_id == parent) && (entry.type == type) && (!strcmp(entry.name, name)))
-            return i;
+    uint64_t bucket = hash_child(parent, name) & index_mask;
+    for (uint64_t i = index_buckets[bucket]; i; i = index_chain[i - 1]) {
+        entry_t *entry = &dir_table[i - 1];
+        if ((entry->parent_id == parent) && (entry->type == type) && (!strcmp(entry->name, name)))
+            return i - 1;
     }
+    return SEARCH_FAILURE;
 }
 
 static path_result_t path_resolver(const char *path, uint8_t type) {
@@ -325,23 +726,21 @@ next:
     goto next;
 }
 
-static inline uint64_t get_free_id(void) {
-    uint64_t id = 1;
-    uint64_t i;
-
-    uint64_t loc = (dirstart * bytesperblock);
-    echfs_fseek(image, (long)loc, SEEK_SET);
+// slots below the cursor are all in use; nothing frees slots during a run,
+// so each slot is looked at once
+static uint64_t free_slot_cursor;
 
-    for (i = 0; ; i++) {
-        entry_t entry;
-        fread(&entry, sizeof(entry_t), 1, image);
-        if (!entry.parent_id)
-            break;
-        if ((entry.type == 1) && (entry.payload == id))
-            id = (entry.payload + 1);
+static uint64_t find_free_slot(void) {
+    uint64_t max_entries = dirsize * ENTRIES_PER_BLOCK;
+    for (; free_slot_cursor < max_entries; free_slot_cursor++) {
+        if (free_slot_cursor >= dir_entries || !is_live_entry(&dir_table[free_slot_cursor]))
+            return free_slot_cursor;
     }
+    return SEARCH_FAILURE;
+}
 
-    return id;
+static inline uint64_t get_free_id(void) {
+    return next_dir_id++;
 }
 
 static void mkdir_cmd(int argc, char **argv) {
@@ -361,14 +760,10 @@ static void mkdir_cmd(int argc, char **argv) {
         return;
     }
 
-    // find empty entry
-    uint64_t loc = (dirstart * bytesperblock);
-    echfs_fseek(image, (long)loc, SEEK_SET);
-    for (i = 0; ; i++) {
-        entry_t entry_i;
-        fread(&entry_i, sizeof(entry_t), 1, image);
-        if ((entry_i.parent_id == 0) || (entry_i.parent_id == DELETED_ENTRY))
-            break;
+    i = find_free_slot();
+    if (i == SEARCH_FAILURE) {
+        fprintf(stderr, "%s: %s: error: the directory is full.\n", argv[0], argv[2]);
+        return;
     }
 
     entry.parent_id = path_result.parent.payload;
@@ -446,16 +841,25 @@ subdir:
         return;
     }
 
-    uint64_t payload = import_chain(source);
+    // the old chain is only dropped once the new one is in place, so a
+    // failed import leaves the file as it was
+    if (import_chain(source, &entry)) {
+        fprintf(stderr, "%s: %s: error: couldn't import `%s`, not enough space or a short read.\n", argv[0], argv[2], argv[3]);
+        fclose(source);
+        return;
+    }
 
     if (!path_result.not_found) {
-        path_result.target.payload = payload;
+        uint64_t old_payload = path_result.target.payload;
+        path_result.target.payload = entry.payload;
+        path_result.target.size = entry.size;
 #ifdef __APPLE__
         path_result.target.mtime = s.st_mtimespec.tv_sec;
 #else
         path_result.target.mtime = s.st_mtim.tv_sec;
 #endif
         wr_entry(path_result.target_entry, &path_result.target);
+        delete_chain(old_payload);
         fclose(source);
         return;
     }
@@ -463,9 +867,6 @@ subdir:
     entry.parent_id = path_result.parent.payload;
     entry.type = FILE_TYPE;
     strcpy(entry.name, path_result.name);
-    entry.payload = payload;
-    fseek(source, 0L, SEEK_END);
-    entry.size = (uint64_t)ftell(source);
 
 #ifdef __APPLE__
     entry.ctime = s.st_ctimespec.tv_sec;
@@ -479,14 +880,12 @@ subdir:
 
     entry.perms = (uint16_t)(s.st_mode & ((1 << 9)-1));
 
-    // find empty entry
-    uint64_t loc = (dirstart * bytesperblock);
-    echfs_fseek(image, (long)loc, SEEK_SET);
-    for (i = 0; ; i++) {
-        entry_t entry_i;
-        fread(&entry_i, sizeof(entry_t), 1, image);
-        if ((entry_i.parent_id == 0) || (entry_i.parent_id == DELETED_ENTRY))
-            break;
+    i = find_free_slot();
+    if (i == SEARCH_FAILURE) {
+        fprintf(stderr, "%s: %s: error: the directory is full.\n", argv[0], argv[2]);
+        delete_chain(entry.payload);
+        fclose(source);
+        return;
     }
     wr_entry(i, &entry);
 
@@ -520,13 +919,436 @@ static void export_cmd(int argc, char **argv) {
         return;
     }
 
-    export_chain(dest, path_result.target);
+    if (export_chain(dest, path_result.target) | fclose(dest)) {
+        fprintf(stderr, "%s: %s: error: couldn't export `%s`.\n", argv[0], argv[2], argv[3]);
+        return;
+    }
 
-    fclose(dest);
     if (verbose) fprintf(stdout, "exported file `%s` as `%s`\n", argv[3], argv[4]);
     return;
 }
 
+// the tree commands stage directory entries in dir_table and write the
+// touched slots back in one go
+static uint64_t tree_dirty_lo = SEARCH_FAILURE;
+static uint64_t tree_dirty_hi;
+
+static void tree_set_entry(uint64_t slot, entry_t *entry) {
+    dir_table_update(slot, entry);
+    if (slot < tree_dirty_lo)
+        tree_dirty_lo = slot;
+    if (slot + 1 > tree_dirty_hi)
+        tree_dirty_hi = slot + 1;
+}
+
+static void tree_store_dir(void) {
+    if (!image_map && tree_dirty_lo < tree_dirty_hi)
+        wr_image(dir_table + tree_dirty_lo, (tree_dirty_hi - tree_dirty_lo) * sizeof(entry_t),
+                 dirstart * bytesperblock + tree_dirty_lo * sizeof(entry_t));
+}
+
+typedef struct {
+    char *host_path;
+    uint64_t entry;
+} tree_job_t;
+
+static tree_job_t *tree_jobs;
+static uint64_t tree_job_count;
+static uint64_t tree_job_capacity;
+static uint64_t tree_next_job;
+static int tree_to_image;
+static int tree_errors;
+static pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void tree_add_job(const char *host_path, uint64_t entry) {
+    if (tree_job_count == tree_job_capacity) {
+        tree_job_capacity = tree_job_capacity ? tree_job_capacity * 2 : 256;
+        tree_jobs = realloc(tree_jobs, tree_job_capacity * sizeof(tree_job_t));
+        if (!tree_jobs) {
+            perror("realloc failure");
+            abort();
+        }
+    }
+    tree_jobs[tree_job_count].host_path = strdup(host_path);
+    tree_jobs[tree_job_count].entry = entry;
+    tree_job_count++;
+}
+
+static void *tree_worker(void *arg) {
+    (void)arg;
+    uint64_t buf_blocks = COPY_BUF_SIZE / bytesperblock;
+    if (!buf_blocks)
+        buf_blocks = 1;
+    uint8_t *buf = malloc(buf_blocks * bytesperblock);
+    if (!buf) {
+        perror("malloc failure");
+        abort();
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&tree_lock);
+        uint64_t i = tree_next_job++;
+        pthread_mutex_unlock(&tree_lock);
+        if (i >= tree_job_count)
+            break;
+
+        tree_job_t *job = &tree_jobs[i];
+        FILE *host = fopen(job->host_path, tree_to_image ? "r" : "w");
+        int err = !host || copy_chain(host, &dir_table[job->entry], tree_to_image, buf, buf_blocks);
+        if (host && fclose(host))
+            err = 1;
+
+        if (err) {
+            fprintf(stderr, "error: couldn't copy `%s`.\n", job->host_path);
+            pthread_mutex_lock(&tree_lock);
+            tree_errors++;
+            pthread_mutex_unlock(&tree_lock);
+        } else if (verbose) {
+            fprintf(stdout, "%s `%s`\n", tree_to_image ? "imported" : "exported", job->host_path);
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+// runs the queued jobs on a pool of worker threads
+static void tree_run_jobs(void) {
+    long threads = jobs;
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+    if ((uint64_t)threads > tree_job_count)
+        threads = tree_job_count ? (long)tree_job_count : 1;
+
+    // the workers bypass the stdio stream
+    fflush(image);
+
+    pthread_t *workers = malloc((size_t)threads * sizeof(pthread_t));
+    if (!workers) {
+        perror("malloc failure");
+        abort();
+    }
+    long started;
+    for (started = 0; started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, tree_worker, NULL))
+            break;
+    }
+    if (!started)
+        tree_worker(NULL);
+    for (long i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+
+    for (uint64_t i = 0; i < tree_job_count; i++)
+        free(tree_jobs[i].host_path);
+    free(tree_jobs);
+    tree_jobs = NULL;
+    tree_job_count = tree_job_capacity = tree_next_job = 0;
+}
+
+// resolves (and with `create` set, makes, with the given permissions) the
+// image directory at path. Returns -1 on failure; the root's ID can't double
+// as an error value.
+static int tree_dir_id(const char *path, int create, uint16_t perms, uint64_t *dir_id) {
+    uint64_t id = ROOT_ID;
+    char name[FILENAME_LEN];
+
+    while (*path) {
+        while (*path == '/')
+            path++;
+        size_t len = strcspn(path, "/");
+        if (!len)
+            break;
+        if (len >= FILENAME_LEN)
+            return -1;
+        memcpy(name, path, len);
+        name[len] = 0;
+        path += len;
+
+        uint64_t slot = search(name, id, DIRECTORY_TYPE);
+        if (slot != SEARCH_FAILURE) {
+            id = dir_table[slot].payload;
+            continue;
+        }
+        if (!create)
+            return -1;
+
+        slot = find_free_slot();
+        if (slot == SEARCH_FAILURE)
+            return -1;
+
+        entry_t entry = {0};
+        entry.parent_id = id;
+        entry.type = DIRECTORY_TYPE;
+        strcpy(entry.name, name);
+        entry.payload = get_free_id();
+        entry.ctime = entry.atime = entry.mtime = (uint64_t)time(NULL);
+        entry.perms = perms;
+        tree_set_entry(slot, &entry);
+        id = entry.payload;
+    }
+
+    *dir_id = id;
+    return 0;
+}
+
+// walks a host directory, creating directories and allocating chains for
+// its files as it goes; the data itself is copied afterwards by the workers
+static void import_tree_dir(const char *host_dir, uint64_t parent) {
+    DIR *dir = opendir(host_dir);
+    if (!dir) {
+        fprintf(stderr, "error: couldn't open `%s`.\n", host_dir);
+        tree_errors++;
+        return;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+
+        char *host_path = malloc(strlen(host_dir) + strlen(ent->d_name) + 2);
+        if (!host_path) {
+            perror("malloc failure");
+            abort();
+        }
+        sprintf(host_path, "%s/%s", host_dir, ent->d_name);
+
+        struct stat s;
+        if (lstat(host_path, &s)) {
+            fprintf(stderr, "error: couldn't access `%s`.\n", host_path);
+            tree_errors++;
+            goto next;
+        }
+        if (!S_ISDIR(s.st_mode) && !S_ISREG(s.st_mode)) {
+            fprintf(stderr, "warning: skipping `%s`, not a regular file or directory.\n", host_path);
+            goto next;
+        }
+        if (strlen(ent->d_name) >= FILENAME_LEN) {
+            fprintf(stderr, "error: name of `%s` is too long.\n", host_path);
+            tree_errors++;
+            goto next;
+        }
+
+        uint8_t type = S_ISDIR(s.st_mode) ? DIRECTORY_TYPE : FILE_TYPE;
+        uint64_t slot = search(ent->d_name, parent, type);
+        entry_t entry = {0};
+
+        if (slot != SEARCH_FAILURE) {
+            entry = dir_table[slot];
+            if (type == DIRECTORY_TYPE) {
+                import_tree_dir(host_path, entry.payload);
+                goto next;
+            }
+            if (!force) {
+                fprintf(stderr, "error: file `%s` already exists.\n", host_path);
+                tree_errors++;
+                goto next;
+            }
+            delete_chain(entry.payload);
+        } else {
+            slot = find_free_slot();
+            if (slot == SEARCH_FAILURE) {
+                fprintf(stderr, "error: directory full, can't import `%s`.\n", host_path);
+                tree_errors++;
+                goto next;
+            }
+            entry.parent_id = parent;
+            entry.type = type;
+            strcpy(entry.name, ent->d_name);
+        }
+
+#ifdef __APPLE__
+        entry.ctime = s.st_ctimespec.tv_sec;
+        entry.atime = s.st_atimespec.tv_sec;
+        entry.mtime = s.st_mtimespec.tv_sec;
+#else
+        entry.ctime = s.st_ctim.tv_sec;
+        entry.atime = s.st_atim.tv_sec;
+        entry.mtime = s.st_mtim.tv_sec;
+#endif
+        entry.perms = (uint16_t)(s.st_mode & ((1 << 9)-1));
+
+        if (type == DIRECTORY_TYPE) {
+            entry.payload = get_free_id();
+            tree_set_entry(slot, &entry);
+            import_tree_dir(host_path, entry.payload);
+            goto next;
+        }
+
+        entry.size = (uint64_t)s.st_size;
+        uint64_t payload;
+        if (alloc_chain((entry.size + bytesperblock - 1) / bytesperblock, &payload)) {
+            fprintf(stderr, "error: out of space, can't import `%s`.\n", host_path);
+            tree_errors++;
+            if (is_live_entry(&dir_table[slot])) {
+                // the old chain is gone already
+                entry.payload = END_OF_CHAIN;
+                entry.size = 0;
+                tree_set_entry(slot, &entry);
+            }
+            goto next;
+        }
+        entry.payload = payload;
+        tree_set_entry(slot, &entry);
+        tree_add_job(host_path, slot);
+
+next:
+        free(host_path);
+    }
+
+    closedir(dir);
+}
+
+static void import_tree_cmd(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "%s: %s: missing argument: source directory.\n", argv[0], argv[2]);
+        return;
+    }
+    if (argc < 5) {
+        fprintf(stderr, "%s: %s: missing argument: destination directory.\n", argv[0], argv[2]);
+        return;
+    }
+
+    // directories made along the destination path take the source's mode
+    struct stat s;
+    if (stat(argv[3], &s) || !S_ISDIR(s.st_mode)) {
+        fprintf(stderr, "%s: %s: error: `%s` is not a directory.\n", argv[0], argv[2], argv[3]);
+        return;
+    }
+
+    uint64_t parent;
+    if (tree_dir_id(argv[4], 1, (uint16_t)(s.st_mode & ((1 << 9)-1)), &parent)) {
+        fprintf(stderr, "%s: %s: error: couldn't create directory `%s`.\n", argv[0], argv[2], argv[4]);
+        tree_store_dir();
+        return;
+    }
+
+    import_tree_dir(argv[3], parent);
+
+    // copy the data in parallel, then write the directory in one pass; the
+    // allocation table follows on the way out
+    tree_to_image = 1;
+    tree_run_jobs();
+    tree_store_dir();
+
+    if (tree_errors)
+        fprintf(stderr, "%s: %s: %d error(s) while importing `%s`.\n", argv[0], argv[2], tree_errors, argv[3]);
+}
+
+// orders slots by parent, then by slot
+static int cmp_parent(const void *a, const void *b) {
+    uint64_t sa = *(const uint64_t *)a, sb = *(const uint64_t *)b;
+    uint64_t pa = dir_table[sa].parent_id;
+    uint64_t pb = dir_table[sb].parent_id;
+    if (pa != pb)
+        return (pa > pb) - (pa < pb);
+    return (sa > sb) - (sa < sb);
+}
+
+static void export_tree_cmd(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "%s: %s: missing argument: source directory.\n", argv[0], argv[2]);
+        return;
+    }
+    if (argc < 5) {
+        fprintf(stderr, "%s: %s: missing argument: destination directory.\n", argv[0], argv[2]);
+        return;
+    }
+
+    uint64_t root;
+    if (tree_dir_id(argv[3], 0, 0, &root)) {
+        fprintf(stderr, "%s: %s: error: invalid directory `%s`.\n", argv[0], argv[2], argv[3]);
+        return;
+    }
+
+    // live slots sorted by parent, so that the children of a directory
+    // form one range that can be found with a binary search
+    uint64_t *slots = malloc((dir_entries + 1) * sizeof(uint64_t));
+    uint64_t count = 0;
+    if (!slots) {
+        perror("malloc failure");
+        abort();
+    }
+    for (uint64_t i = 0; i < dir_entries; i++) {
+        if (is_live_entry(&dir_table[i]))
+            slots[count++] = i;
+    }
+    qsort(slots, count, sizeof(uint64_t), cmp_parent);
+
+    // breadth-first walk, the queue holds the host path of each directory
+    typedef struct {
+        char *host_path;
+        uint64_t id;
+    } tree_dir_t;
+    uint64_t queue_len = 1, queue_cap = 16;
+    tree_dir_t *queue = malloc(queue_cap * sizeof(tree_dir_t));
+    if (!queue) {
+        perror("malloc failure");
+        abort();
+    }
+    queue[0].host_path = strdup(argv[4]);
+    queue[0].id = root;
+
+    for (uint64_t q = 0; q < queue_len; q++) {
+        if (mkdir(queue[q].host_path, 0755) && errno != EEXIST) {
+            fprintf(stderr, "%s: %s: error: couldn't create `%s`.\n", argv[0], argv[2], queue[q].host_path);
+            tree_errors++;
+            continue;
+        }
+
+        uint64_t lo = 0, hi = count;
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            if (dir_table[slots[mid]].parent_id < queue[q].id)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        for (; lo < count && dir_table[slots[lo]].parent_id == queue[q].id; lo++) {
+            entry_t *entry = &dir_table[slots[lo]];
+            char *host_path = malloc(strlen(queue[q].host_path) + strlen(entry->name) + 2);
+            if (!host_path) {
+                perror("malloc failure");
+                abort();
+            }
+            sprintf(host_path, "%s/%s", queue[q].host_path, entry->name);
+
+            if (entry->type == FILE_TYPE) {
+                tree_add_job(host_path, slots[lo]);
+                free(host_path);
+                continue;
+            }
+
+            if (queue_len == queue_cap) {
+                queue_cap *= 2;
+                queue = realloc(queue, queue_cap * sizeof(tree_dir_t));
+                if (!queue) {
+                    perror("realloc failure");
+                    abort();
+                }
+            }
+            queue[queue_len].host_path = host_path;
+            queue[queue_len].id = entry->payload;
+            queue_len++;
+        }
+    }
+
+    for (uint64_t q = 0; q < queue_len; q++)
+        free(queue[q].host_path);
+    free(queue);
+    free(slots);
+
+    tree_to_image = 0;
+    tree_run_jobs();
+
+    if (tree_errors)
+        fprintf(stderr, "%s: %s: %d error(s) while exporting `%s`.\n", argv[0], argv[2], tree_errors, argv[3]);
+}
+
 static void ls_cmd(int argc, char **argv) {
     uint64_t id;
 
@@ -556,6 +1378,91 @@ static void ls_cmd(int argc, char **argv) {
     return;
 }
 
+// rewrites the directory without its deleted entries, keeping the entries
+// of each directory together, and moves the end marker down to match
+static void compact_cmd(void) {
+    uint64_t *slots = malloc((dir_entries + 1) * sizeof(uint64_t));
+    entry_t *live = malloc((dir_entries + 1) * sizeof(entry_t));
+    if (!slots || !live) {
+        perror("malloc failure");
+        abort();
+    }
+
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < dir_entries; i++) {
+        if (is_live_entry(&dir_table[i]))
+            slots[count++] = i;
+    }
+    qsort(slots, count, sizeof(uint64_t), cmp_parent);
+    for (uint64_t i = 0; i < count; i++)
+        live[i] = dir_table[slots[i]];
+
+    uint64_t old_entries = dir_entries;
+    entry_t empty = {0};
+    for (uint64_t i = 0; i < old_entries; i++)
+        tree_set_entry(i, i < count ? &live[i] : &empty);
+    tree_store_dir();
+
+    free(live);
+    free(slots);
+    if (verbose) fprintf(stdout, "compacted %" PRIu64 " directory entries into %" PRIu64 "\n",
+                         old_entries, count);
+}
+
+// releases [start, end) of the image without writing it. A hole punched in
+// a regular file reads back as zeroes; discarded device blocks may not, so
+// `zeroed` says whether the range can be relied on to be zero afterwards
+static int discard_image(uint64_t start, uint64_t end, int *zeroed) {
+    int fd = fileno(image);
+    struct stat st;
+    if (fstat(fd, &st))
+        return -1;
+
+#ifdef __linux__
+    if (S_ISBLK(st.st_mode)) {
+        uint64_t range[2] = { part_offset + start, end - start };
+        *zeroed = 0;
+        return ioctl(fd, BLKDISCARD, range) ? -1 : 0;
+    }
+#endif
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (S_ISREG(st.st_mode)) {
+        *zeroed = 1;
+        return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                         (off_t)(part_offset + start), (off_t)(end - start));
+    }
+#endif
+    return -1;
+}
+
+// zeroes [start, end) of the image in large writes, showing the progress at
+// most once per percent
+static int zero_image(uint64_t start, uint64_t end) {
+    uint8_t *zeroes = calloc(COPY_BUF_SIZE, 1);
+    if (!zeroes)
+        return -1;
+
+    unsigned shown = 0;
+    for (uint64_t loc = start; loc < end; ) {
+        uint64_t len = end - loc < COPY_BUF_SIZE ? end - loc : COPY_BUF_SIZE;
+        if (pwrite_image(zeroes, len, loc)) {
+            free(zeroes);
+            return -1;
+        }
+        loc += len;
+
+        unsigned percent = (unsigned)((loc - start) * 100 / (end - start));
+        if (verbose && percent != shown) {
+            fprintf(stdout, "\rzeroing: %u%%", percent);
+            fflush(stdout);
+            shown = percent;
+        }
+    }
+    if (verbose) fputc('\n', stdout);
+    free(zeroes);
+    return 0;
+}
+
 static void format_pass1(int argc, char **argv, int quick) {
 
     if (argc <= 3) {
@@ -581,14 +1488,16 @@ static void format_pass1(int argc, char **argv, int quick) {
     }
 
     blocks = imgsize / bytesperblock;
+    // the same sizes the header is read back as, for format_pass2()
+    fatsize = (blocks * sizeof(uint64_t) + bytesperblock - 1) / bytesperblock;
+    dirsize = blocks / 20; // roughly 5% of the total
 
     // write signature
-    echfs_fseek(image, 4, SEEK_SET);
-    fputs("_ECH_FS_", image);
+    wr_image("_ECH_FS_", 8, 4);
     // total blocks
     wr_qword(12, blocks);
     // directory size
-    wr_qword(20, blocks / 20); // blocks / 20 (roughly 5% of the total)
+    wr_qword(20, dirsize);
     // block size
     wr_qword(28, bytesperblock);
 
@@ -603,22 +1512,28 @@ static void format_pass1(int argc, char **argv, int quick) {
     puts(uuid_str);
 
     if (!quick) {
-        echfs_fseek(image, (RESERVED_BLOCKS * bytesperblock), SEEK_SET);
-        if (verbose) fprintf(stdout, "zeroing");
-
-        // zero out the rest of the image
-        uint8_t *zeroblock = calloc(bytesperblock, 1);
-        if (!zeroblock) {
-            perror("calloc failure");
-            abort();
-        }
-        for (uint64_t i = (RESERVED_BLOCKS * bytesperblock); i < imgsize; i += bytesperblock) {
-            fwrite(zeroblock, bytesperblock, 1, image);
-            if (verbose) fputc('.', stdout);
+        // release the rest of the image if possible. The allocation table
+        // and directory have to read back as zeroes, so where releasing
+        // doesn't guarantee that they are written out; the data area is
+        // only zeroed when it can't be released at all
+        uint64_t meta_start = RESERVED_BLOCKS * bytesperblock;
+        uint64_t meta_end = (RESERVED_BLOCKS + fatsize + dirsize) * bytesperblock;
+        fflush(image);
+        int zeroed = 0;
+        if (discard_image(meta_start, imgsize, &zeroed)) {
+            if (zero_image(meta_start, imgsize)) {
+                fprintf(stderr, "%s: error: couldn't zero the image.\n", argv[0]);
+                fclose(image);
+                abort();
+            }
+        } else {
+            if (!zeroed && zero_image(meta_start, meta_end)) {
+                fprintf(stderr, "%s: error: couldn't zero the allocation table.\n", argv[0]);
+                fclose(image);
+                abort();
+            }
+            if (verbose) fprintf(stdout, "released the image contents\n");
         }
-        free(zeroblock);
-
-        if (verbose) fputc('\n', stdout);
     }
 
     return;
@@ -626,13 +1541,29 @@ static void format_pass1(int argc, char **argv, int quick) {
 }
 
 static void format_pass2(void) {
-    // mark reserved blocks
-    uint64_t loc = fatstart * bytesperblock;
+    // mark reserved blocks, a buffer of markers at a time
+    uint64_t chunk_entries = COPY_BUF_SIZE / sizeof(uint64_t);
+    uint64_t *chunk = malloc(COPY_BUF_SIZE);
+    if (!chunk) {
+        perror("malloc failure");
+        abort();
+    }
+    for (uint64_t i = 0; i < chunk_entries; i++)
+        chunk[i] = RESERVED_BLOCK;
 
-    for (uint64_t i = 0; i < (RESERVED_BLOCKS + fatsize + dirsize); i++) {
-        wr_qword(loc, RESERVED_BLOCK);
-        loc += sizeof(uint64_t);
+    fflush(image);
+    uint64_t loc = fatstart * bytesperblock;
+    uint64_t count = RESERVED_BLOCKS + fatsize + dirsize;
+    while (count) {
+        uint64_t n = count < chunk_entries ? count : chunk_entries;
+        if (pwrite_image(chunk, n * sizeof(uint64_t), loc)) {
+            fprintf(stderr, "error: couldn't write the allocation table.\n");
+            abort();
+        }
+        loc += n * sizeof(uint64_t);
+        count -= n;
     }
+    free(chunk);
 
     if (verbose) fprintf(stdout, "format complete!\n");
 
@@ -640,9 +1571,16 @@ static void format_pass2(void) {
 }
 
 int main(int argc, char **argv) {
+    static const struct option long_options[] = {
+        { "mmap", no_argument, &use_mmap, 1 },
+        { 0, 0, 0, 0 }
+    };
+
     int opt;
-    while ((opt = getopt(argc, argv, "vmgfp:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "vmgfp:j:", long_options, NULL)) != -1) {
         switch (opt) {
+            case 0:
+                break;
             case 'v':
                 verbose = 1;
                 break;
@@ -658,6 +1596,9 @@ int main(int argc, char **argv) {
             case 'f':
                 force = 1;
                 break;
+            case 'j':
+                jobs = atoi(optarg);
+                break;
             default:
                 fprintf(stderr, "Usage: %s <opts> [image] <action> <args...>\n",
                         argv[0]);
@@ -694,6 +1635,13 @@ int main(int argc, char **argv) {
         rewind(image);
     }
 
+    if (use_mmap && map_image()) {
+        fprintf(stderr, "%s: error: couldn't map `%s`.\n", argv[0],
+                argv[optind]);
+        fclose(image);
+        return EXIT_FAILURE;
+    }
+
     argv[optind - 1] = argv[0];
     argc -= optind - 1;
     argv += optind - 1;
@@ -703,8 +1651,7 @@ int main(int argc, char **argv) {
             argc, argv, 1);
 
     char signature[8] = {0};
-    echfs_fseek(image, 4, SEEK_SET);
-    fread(signature, 8, 1, image);
+    rd_image(signature, 8, 4);
     if (strncmp(signature, "_ECH_FS_", 8)) {
         fprintf(stderr, "%s: error: echidnaFS signature missing.\n", argv[0]);
         fclose(image);
@@ -756,17 +1703,29 @@ int main(int argc, char **argv) {
     }
 
     if (argc > 2) {
+        if (strcmp(argv[2], "format") && strcmp(argv[2], "quick-format"))
+            load_dir();
+        if (!strncmp(argv[2], "import", 6) || !strncmp(argv[2], "export", 6))
+            load_fat();
+
         if (!strcmp(argv[2], "mkdir")) mkdir_cmd(argc, argv);
         else if (!strcmp(argv[2], "ls")) ls_cmd(argc, argv);
         else if (!strcmp(argv[2], "format")) format_pass2();
         else if (!strcmp(argv[2], "quick-format")) format_pass2();
         else if (!strcmp(argv[2], "import")) import_cmd(argc, argv);
         else if (!strcmp(argv[2], "export")) export_cmd(argc, argv);
+        else if (!strcmp(argv[2], "import-tree")) import_tree_cmd(argc, argv);
+        else if (!strcmp(argv[2], "export-tree")) export_tree_cmd(argc, argv);
+        else if (!strcmp(argv[2], "compact")) compact_cmd();
 
         else fprintf(stderr, "%s: error: invalid action: `%s`.\n", argv[0], argv[2]);
     } else
         fprintf(stderr, "%s: no action specified, exiting.\n", argv[0]);
 
+    if (fat)
+        store_fat();
+    if (image_map)
+        unmap_image();
     fclose(image);
 
     return EXIT_SUCCESS;
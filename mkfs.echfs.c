@@ -1,10 +1,22 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 #define RESERVED_BLOCKS         16
+#define RESERVED_BLOCK          0xfffffffffffffff0
+#define WRITE_CHUNK             (1024 * 1024)
 
 // boot sector code in boot.asm
 extern const uint8_t _binary_boot_bin_start[];
@@ -17,23 +29,122 @@ static inline void wr_qword(uint64_t loc, uint64_t x) {
     return;
 }
 
+static int write_all(int fd, const void *buf, uint64_t count, uint64_t loc) {
+    while (count) {
+        ssize_t ret = pwrite(fd, buf, count, loc);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        buf = (const uint8_t *)buf + ret;
+        count -= ret;
+        loc += ret;
+    }
+    return 0;
+}
+
+// writes zeroes over [start, end) in large writes
+static int zero_range(int fd, uint64_t start, uint64_t end) {
+    uint8_t *zeroes = calloc(WRITE_CHUNK, 1);
+    if (!zeroes)
+        return -1;
+    while (start < end) {
+        uint64_t n = end - start < WRITE_CHUNK ? end - start : WRITE_CHUNK;
+        if (write_all(fd, zeroes, n, start)) {
+            free(zeroes);
+            return -1;
+        }
+        start += n;
+    }
+    free(zeroes);
+    return 0;
+}
+
+/*
+ * makes [start, end) of the image read back as zeroes while writing as
+ * little as possible: holes are punched in a regular file. Discarded
+ * blocks of a device may not read back as zeroes, so there the allocation
+ * table and directory, [start, data_start), are written out and only the
+ * data area, whose contents don't matter, is discarded.
+ */
+static int discard_range(int fd, uint64_t start, uint64_t data_start,
+        uint64_t end) {
+    struct stat st;
+    if (fstat(fd, &st))
+        return -1;
+
+#ifdef __linux__
+    if (S_ISBLK(st.st_mode)) {
+        if (zero_range(fd, start, data_start))
+            return -1;
+        uint64_t range[2] = { data_start, end - data_start };
+        return ioctl(fd, BLKDISCARD, range) ? -1 : 0;
+    }
+#endif
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (!fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                (off_t)start, (off_t)(end - start)))
+        return 0;
+#endif
+
+    // no hole punching, cut the file down and grow it back as a hole
+    if (!S_ISREG(st.st_mode) || (uint64_t)st.st_size != end)
+        return -1;
+    if (ftruncate(fd, (off_t)start) || ftruncate(fd, (off_t)end))
+        return -1;
+    return 0;
+}
+
+// fills the FAT entries of the reserved blocks in large writes
+static int mark_reserved(int fd, uint64_t loc, uint64_t count) {
+    uint64_t chunk_entries = WRITE_CHUNK / sizeof(uint64_t);
+    uint64_t *chunk = malloc(WRITE_CHUNK);
+    if (!chunk)
+        return -1;
+    for (uint64_t i = 0; i < chunk_entries; i++)
+        chunk[i] = RESERVED_BLOCK;
+
+    while (count) {
+        uint64_t n = count < chunk_entries ? count : chunk_entries;
+        if (write_all(fd, chunk, n * sizeof(uint64_t), loc)) {
+            free(chunk);
+            return -1;
+        }
+        loc += n * sizeof(uint64_t);
+        count -= n;
+    }
+    free(chunk);
+    return 0;
+}
+
 int main(int argc, char **argv) {
     const uint8_t *boot_sector = _binary_boot_bin_start;
 
+    int discard = 0;
+    int args = 1;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--discard"))
+            discard = 1;
+        else
+            argv[args++] = argv[i];
+    }
+    argc = args;
+
     if (argc < 4) {
-          fprintf(stderr, "%s: usage: %s <image> <bytes per block> <reserved blocks factor>\n", argv[0], argv[0]);
+          fprintf(stderr, "%s: usage: %s [--discard] <image> <bytes per block> <reserved blocks factor>\n", argv[0], argv[0]);
           return 1;
     }
-    image = fopen(argv[1], "rb");
+    image = fopen(argv[1], "r+");
     if (image == NULL) {
          fprintf(stderr, "%s: error: no valid image specified.\n", argv[0]);
+         return 1;
     }
+    int fd = fileno(image);
 
     fseek(image, 0L, SEEK_END);
-    uint64_t imgsize = (uint64_t)ftell(image);
+    uint64_t imgsize = (uint64_t)ftello(image);
     rewind(image);
-    fclose(image);
-    image = fopen(argv[1], "r+");
 
     fprintf(stderr, "%s: info: formatting %lu bytes...\n", argv[0], imgsize);
 
@@ -60,6 +171,22 @@ int main(int argc, char **argv) {
     }
 
     uint64_t blocks = imgsize / bytesperblock;
+    uint64_t fatsize = (blocks * sizeof(uint64_t) + bytesperblock - 1) / bytesperblock;
+    uint64_t dirsize = blocks / (100 / reserved_factor);
+
+    if (RESERVED_BLOCKS + fatsize + dirsize >= blocks) {
+        fprintf(stderr, "%s: error: image is too small.\n", argv[0]);
+        fclose(image);
+        return 1;
+    }
+
+    // without this the image is expected to be zeroed already
+    if (discard && discard_range(fd, RESERVED_BLOCKS * bytesperblock,
+                (RESERVED_BLOCKS + fatsize + dirsize) * bytesperblock, imgsize)) {
+        fprintf(stderr, "%s: error: could not discard the image.\n", argv[0]);
+        fclose(image);
+        return 1;
+    }
 
     fseek(image, 0, SEEK_SET);
     fwrite(boot_sector, 512, 1, image);
@@ -67,19 +194,18 @@ int main(int argc, char **argv) {
     fseek(image, 4, SEEK_SET);
     fputs("_ECH_FS_", image);
     wr_qword(12, blocks);	// blocks
-    wr_qword(20, blocks / (100 / reserved_factor)); 	//reserved blocks
+    wr_qword(20, dirsize); 	//reserved blocks
     wr_qword(28, bytesperblock);	// block size
-    // mark reserved blocks
-    uint64_t loc = RESERVED_BLOCKS * bytesperblock;
-
-    uint64_t fatsize = (blocks * sizeof(uint64_t)) / bytesperblock;
-    uint64_t dirsize = blocks / (100 / reserved_factor);
+    fflush(image);
 
-    for (uint64_t i = 0; i < (RESERVED_BLOCKS + fatsize + dirsize); i++) {
-        wr_qword(loc, 0xfffffffffffffff0);
-        loc += sizeof(uint64_t);
+    // mark reserved blocks
+    if (mark_reserved(fd, RESERVED_BLOCKS * bytesperblock,
+                RESERVED_BLOCKS + fatsize + dirsize)) {
+        fprintf(stderr, "%s: error: could not write the allocation table.\n", argv[0]);
+        fclose(image);
+        return 1;
     }
-    fflush(image);
+
     fclose(image);
     return 0;
 }